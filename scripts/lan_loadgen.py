@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+# Copyright (c) 2024 Muhammad Waleed.
+# SPDX-License-Identifier: Apache-2.0
+
+"""Host-side load generator for the UDP LAN fast path (CONFIG_APP_LAN_CONTROL).
+
+Sends LAN_OP_SET datagrams (see src/app/inc/lan.h) to one or more nodes and
+times each request until its reply. A node replies only after the relay has
+been driven, so the round trip is an upper bound on command-to-actuate time.
+
+Against the native_sim fleet simulator (node N listens on 4210 + N):
+
+    west build -b native_sim . && ./build/zephyr/zephyr.exe &
+    scripts/lan_loadgen.py --nodes 16 --rate 200 --count 5000
+
+The exit status is non-zero if the p99 round trip exceeds --budget-ms.
+"""
+
+import argparse
+import select
+import socket
+import struct
+import sys
+import time
+
+LAN_OP_SET = 0x01
+LAN_OP_REPLY = 0x80
+MSG = struct.Struct("2sBBBB")  # magic, op, channel, state, seq
+
+
+def percentile(sorted_values, pct):
+    if not sorted_values:
+        return float("nan")
+    index = min(len(sorted_values) - 1, int(round(pct / 100.0 * (len(sorted_values) - 1))))
+    return sorted_values[index]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=4210, help="port of node 0")
+    parser.add_argument("--nodes", type=int, default=1)
+    parser.add_argument("--channels", type=int, default=2)
+    parser.add_argument("--rate", type=float, default=100.0, help="requests per second")
+    parser.add_argument("--count", type=int, default=1000)
+    parser.add_argument("--timeout", type=float, default=0.5, help="seconds before a request is lost")
+    parser.add_argument("--budget-ms", type=float, default=10.0)
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setblocking(False)
+
+    pending = {}  # (node, seq) -> send time
+    rtts = []
+    lost = 0
+    bad = 0
+    interval = 1.0 / args.rate
+    next_send = time.perf_counter()
+    sent = 0
+
+    while sent < args.count or pending:
+        now = time.perf_counter()
+
+        if sent < args.count and now >= next_send:
+            node = sent % args.nodes
+            channel = (sent // args.nodes) % args.channels
+            state = (sent // (args.nodes * args.channels)) & 1
+            seq = (sent // args.nodes) & 0xFF
+            pending[(node, seq)] = now
+            sock.sendto(MSG.pack(b"HA", LAN_OP_SET, channel, state, seq),
+                        (args.host, args.port + node))
+            sent += 1
+            next_send += interval
+
+        # Expire requests whose reply never came
+        for key, t in list(pending.items()):
+            if now - t > args.timeout:
+                del pending[key]
+                lost += 1
+
+        wait = max(0.0, next_send - time.perf_counter()) if sent < args.count else args.timeout
+        readable, _, _ = select.select([sock], [], [], min(wait, 0.01))
+        if not readable:
+            continue
+
+        while True:
+            try:
+                data, (_, port) = sock.recvfrom(64)
+            except BlockingIOError:
+                break
+            done = time.perf_counter()
+            if len(data) != MSG.size:
+                bad += 1
+                continue
+            magic, op, _, _, seq = MSG.unpack(data)
+            start = pending.pop((port - args.port, seq), None)
+            if magic != b"HA" or not op & LAN_OP_REPLY or start is None:
+                bad += 1
+                continue
+            rtts.append((done - start) * 1000.0)
+
+    rtts.sort()
+    within = sum(1 for r in rtts if r <= args.budget_ms)
+    print(f"sent {sent}, replies {len(rtts)}, lost {lost}, bad {bad}")
+    if rtts:
+        print(f"round trip ms: p50 {percentile(rtts, 50):.2f}, p95 {percentile(rtts, 95):.2f}, "
+              f"p99 {percentile(rtts, 99):.2f}, max {rtts[-1]:.2f}")
+        print(f"within {args.budget_ms:g} ms: {100.0 * within / len(rtts):.1f}%")
+
+    return 0 if rtts and percentile(rtts, 99) <= args.budget_ms else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
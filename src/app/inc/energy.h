@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef ENERGY_H
+#define ENERGY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Running sums for one current-sense channel, in raw ADC counts. */
+struct energy_acc {
+    int64_t sum;
+    uint64_t sum_sq;
+    uint32_t count;
+    int16_t min;
+    int16_t max;
+};
+
+/* Aggregated values published for one relay. */
+struct energy_report {
+    uint32_t irms_ma;
+    uint32_t peak_ma;
+    uint64_t energy_mwh;
+};
+
+/* Fixed-point kernel, free of Zephyr dependencies so it also builds on a host. */
+void energy_acc_reset(struct energy_acc *acc);
+void energy_accumulate(struct energy_acc *acc, const int16_t *samples, size_t count, size_t stride);
+void energy_acc_merge(struct energy_acc *dst, const struct energy_acc *src);
+uint32_t energy_acc_rms(const struct energy_acc *acc);
+uint32_t energy_acc_peak(const struct energy_acc *acc);
+
+/* Number of current-sense channels wired in the devicetree. */
+uint8_t energy_channels(void);
+
+/* Configure the ADC and start timer-paced sampling, negative errno if the ADC cannot be read. */
+int8_t energy_init(void);
+
+/* Milliseconds until the next aggregate is due, 0 if overdue, INT64_MAX when not sampling. */
+int64_t energy_time_left(void);
+
+/* Fill the report for a channel and restart its interval aggregates. */
+void energy_take(uint8_t index, struct energy_report *report);
+
+#endif
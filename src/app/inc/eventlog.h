@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zephyr/toolchain.h>
+
+/* One relay change as stored in flash. Erased flash reads as seq 0xffffffff. */
+struct event_record {
+    uint32_t seq;
+    uint32_t uptime_ms;
+    uint16_t boot;
+    uint8_t channel;
+    uint8_t source;
+    uint8_t state;
+    uint8_t reserved[3];
+} __packed;
+
+/* Prepended to every uploaded chunk so records can be put on a wall clock. */
+struct event_chunk_hdr {
+    uint16_t boot;
+    uint16_t count;
+    uint32_t uptime_ms;
+} __packed;
+
+/* Read position for bulk upload. */
+struct event_log_cursor {
+    uint32_t off;
+    uint32_t left;
+    uint32_t from_seq;
+};
+
+/* Find the write position in the flash ring. Call before the first event. */
+int8_t event_log_init(void);
+
+/* Append an event to the RAM batch. Safe to call from ISRs. */
+void event_log(uint8_t channel, uint8_t source, uint8_t state);
+
+/* Write out the RAM batch now and wait for it. */
+void event_log_flush(void);
+
+/* Write out the RAM batch and start reading at the oldest record >= from_seq. */
+int8_t event_log_open(struct event_log_cursor *cursor, uint32_t from_seq);
+
+/* Read up to max records, returns the number read, 0 at the end. */
+int event_log_read(struct event_log_cursor *cursor, struct event_record *buf, size_t max);
+
+/* Current boot number, for struct event_chunk_hdr. */
+uint16_t event_log_boot(void);
+
+#endif
@@ -7,6 +7,8 @@
 #ifndef GPIO_CONFIG_H
 #define GPIO_CONFIG_H
 
+#include <zephyr/drivers/gpio.h>
+
 #define digital_read(input) gpio_pin_get_dt(input)
 #define digital_write(output, val) gpio_pin_set_dt(output, val)
 
@@ -16,6 +18,15 @@
 /* Define Number of relay to be used. */
 #define maxRelays 2
 
+/* Who asked for a relay change, recorded in the event log. */
+enum relay_source {
+    RELAY_SRC_BOOT,
+    RELAY_SRC_BUTTON,
+    RELAY_SRC_MQTT,
+    RELAY_SRC_RULE,
+    RELAY_SRC_LAN,
+};
+
 /* Device Tree interface for Button.  */
 extern struct gpio_dt_spec buttons[maxButtons];
 
@@ -25,5 +36,20 @@ extern struct gpio_dt_spec relays[maxRelays];
 /* GPIO Direction Control  */
 uint8_t pin_mode(struct gpio_dt_spec *user_gpio, uint32_t dir);
 
+/* Drive a relay and record why. Safe to call from ISRs. */
+void relay_set(uint8_t index, bool state, enum relay_source source);
+
+/* Last state written by relay_set() */
+bool relay_get(uint8_t index);
+
+/* Ask the MQTT loop to publish a relay changed by someone else */
+void relay_notify(uint8_t index);
+
+/* Relays passed to relay_notify() since the last call, as a bitmask */
+uint32_t relay_take_pending(void);
+
+/* Pollable fd that becomes readable after any button edge, -1 if unavailable */
+int gpio_event_fd(void);
+
 #endif
 
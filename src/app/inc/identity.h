@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef IDENTITY_H
+#define IDENTITY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Client id derived from the hardware unique id ("zephyr-<hex>") and topic
+ * prefix from the "app/prefix" setting, falling back to MQTT_CLIENTID and
+ * CONFIG_APP_TOPIC_PREFIX.
+ */
+int8_t node_identity(char *client_id, size_t id_len, char *prefix, size_t prefix_len);
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef LAN_H
+#define LAN_H
+
+#include <stdint.h>
+#include <zephyr/toolchain.h>
+
+#include "mqtt.h"
+
+#define LAN_MAGIC0 'H'
+#define LAN_MAGIC1 'A'
+
+/* Request ops; a reply echoes the request with LAN_OP_REPLY set. */
+#define LAN_OP_SET   0x01
+#define LAN_OP_GET   0x02
+#define LAN_OP_REPLY 0x80
+
+/*
+ * Fixed 6-byte datagram, same layout both ways. In a reply, state holds
+ * the relay bit mask after the command and seq is echoed for matching.
+ */
+struct lan_msg {
+    uint8_t magic[2];
+    uint8_t op;
+    uint8_t channel;
+    uint8_t state;
+    uint8_t seq;
+} __packed;
+
+/* Bind the UDP control socket, returns the fd or a negative errno. */
+int lan_open(uint16_t port);
+
+/* Handle every pending datagram on node->lan_fd without blocking. */
+void lan_serve(struct mqtt_node *node);
+
+#endif
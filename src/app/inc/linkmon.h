@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef LINKMON_H
+#define LINKMON_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Link telemetry published on <prefix>/metrics/link */
+struct link_stats {
+    int8_t rssi;
+    int8_t rssi_avg;
+    uint8_t channel;
+    uint32_t detections;
+    /* Detection of the last outage to MQTT connected again, in ms */
+    uint32_t recovery_ms;
+    uint32_t recovery_max_ms;
+};
+
+/* Start periodic sampling; returns an fd that is readable on link events. */
+int link_monitor_init(void);
+
+/* Wi-Fi dropped, called from the disconnect event. */
+void link_lost(void);
+
+/* True once per detected degradation: tear MQTT down and reconnect. */
+bool link_take_teardown(void);
+
+/* MQTT is connected again, closes an open outage. */
+void link_mqtt_up(void);
+
+/* Milliseconds until the next telemetry report is due. */
+int64_t link_time_left(void);
+
+/* Copy the stats and restart the report period. */
+void link_stats_take(struct link_stats *stats);
+
+#endif
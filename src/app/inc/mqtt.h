@@ -9,6 +9,14 @@
 #ifndef MQTT_CONFIG_H
 #define MQTT_CONFIG_H
 
+#include <zephyr/net/socket.h>
+#include <zephyr/net/mqtt.h>
+
+#include "gpio.h"
+#ifdef CONFIG_APP_EVENT_LOG
+#include "eventlog.h"
+#endif
+
 #ifdef CONFIG_NET_CONFIG_SETTINGS
 #define SERVER_ADDR		"192.168.1.102"
 #define SERVER_PORT		1883
@@ -16,6 +24,7 @@
 
 #define APP_CONNECT_TIMEOUT_MS	5000
 #define APP_SLEEP_MSECS		100
+#define APP_RECONNECT_MSECS	1000
 
 #define APP_CONNECT_TRIES	10
 
@@ -23,12 +32,108 @@
 
 #define MQTT_CLIENTID		"zephyr"
 
-/* The mqtt client connections status */
-extern bool connected;
+#define APP_CLIENTID_LEN	24
+#define APP_PREFIX_LEN		32
+#define APP_TOPIC_LEN		48
+
+/* A topic string with its length, built once at boot */
+struct app_topic {
+	char name[APP_TOPIC_LEN];
+	uint16_t len;
+};
+
+/* Poll set slots; unused slots hold fd -1 */
+enum {
+	FDS_BROKER,
+	FDS_LAN,
+	FDS_EVENT,
+	FDS_LINK,
+	FDS_COUNT,
+};
+
+/* One MQTT client with its relay bank and topics */
+struct mqtt_node {
+	struct mqtt_client client;
+	struct sockaddr_storage broker;
+
+	/* Buffers for MQTT client. */
+	uint8_t rx_buffer[APP_MQTT_BUFFER_SIZE];
+	uint8_t tx_buffer[APP_MQTT_BUFFER_SIZE];
+
+	/* Broker socket, LAN control socket, button and link event fds */
+	struct zsock_pollfd fds[FDS_COUNT];
+	int nfds;
+	int event_fd;
+	int lan_fd;
+	int link_fd;
+
+	/* Relays changed by a command but not yet published */
+	uint32_t relay_dirty;
+
+	/* The mqtt client connections status */
+	bool connected;
+
+	char client_id[APP_CLIENTID_LEN];
+
+	/* Topics, built once by mqtt_node_init() as <prefix>/<kind>/outletN */
+	uint16_t prefix_len;
+	struct app_topic pub_topics[maxRelays];
+	struct app_topic sub_topics[maxRelays];
+#ifdef CONFIG_APP_ENERGY_METER
+	struct app_topic energy_topics[maxRelays];
+#endif
+
+	bool previous_state[maxButtons];
+
+#ifdef CONFIG_APP_EVENT_LOG
+	/* Event history upload: request on log/get, chunks on log/data */
+	struct app_topic log_get_topic;
+	struct app_topic log_data_topic;
+	struct event_log_cursor log_cursor;
+	bool log_upload;
+#endif
+
+#ifdef CONFIG_APP_SCHED
+	/* Schedule commands, see sched_command() */
+	struct app_topic sched_topic;
+#endif
+
+#ifdef CONFIG_APP_LINK_MONITOR
+	struct app_topic link_topic;
+#endif
 
-int8_t pub_switch_state(struct gpio_dt_spec *button, uint8_t index, char *pub_topics);
-int8_t sub_relay_state(struct gpio_dt_spec *relay, char *payload, char *pub_topics);
-int8_t pub_sub(void);
+	/* Adaptive keepalive, see keepalive_shrink() */
+	uint16_t keepalive_sec;
+	uint8_t keepalive_ok;
+	int64_t last_activity;
+	/* Uptime when the unanswered ping went out, 0 if none */
+	int64_t ping_sent;
 
+#ifdef CONFIG_APP_SIM
+	/* Virtual buttons/relays and counters for the fleet simulator */
+	bool sim_buttons[maxButtons];
+	bool sim_relays[maxRelays];
+	/* Host clock at the last scripted press, 0 once echoed */
+	uint64_t press_ns[maxButtons];
+	uint32_t tx;
+	uint32_t rx;
 #endif
+};
 
+/* Set up identity and topics; event_fd wakes the node on button edges */
+void mqtt_node_init(struct mqtt_node *node, const char *client_id, const char *prefix, int event_fd);
+
+/* Wait for timeout ms while still serving LAN commands */
+void mqtt_node_idle(struct mqtt_node *node, int timeout);
+
+/* Drive a relay on behalf of a remote command; the state is mirrored to MQTT */
+void node_set_relay(struct mqtt_node *node, uint8_t index, bool state, enum relay_source source);
+
+/* Current relay states as a bit mask */
+uint32_t node_relay_mask(struct mqtt_node *node);
+
+int8_t pub_switch_state(struct mqtt_node *node, uint8_t index);
+int8_t sub_relay_state(struct mqtt_node *node, uint8_t index, char *payload);
+int8_t pub_sub(struct mqtt_node *node);
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Restore persisted schedules and auto-off times. Call once the relays are
+ * set up and before anything that may block on the network.
+ */
+int sched_load(void);
+
+/*
+ * Arm entry id to set relay channel to state after delay_s seconds, then
+ * every period_s seconds (0 for one-shot). Re-adding an id replaces it.
+ * Ids below CONFIG_APP_SCHED_SAVED are saved first; nothing is armed if
+ * the save fails.
+ */
+int8_t sched_add(uint16_t id, uint8_t channel, bool state, uint32_t delay_s, uint32_t period_s);
+
+/* Cancel entry id. */
+int8_t sched_del(uint16_t id);
+
+/* Switch channel off auto_s seconds after it turns on, 0 disables. */
+int8_t sched_auto_off(uint8_t channel, uint32_t auto_s);
+
+/*
+ * Text command from MQTT:
+ *   "add <id> <channel> <0|1> <delay_s> [period_s]"
+ *   "del <id>"
+ *   "auto <channel> <seconds>"
+ */
+int8_t sched_command(char *cmd);
+
+/* Hook from relay_set(), drives auto-off. Safe to call from ISRs. */
+void sched_relay_changed(uint8_t channel, bool state);
+
+#endif
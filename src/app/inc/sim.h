@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include "mqtt.h"
+
+/* Start CONFIG_APP_SIM_NODES virtual nodes and drive scripted button traffic. Never returns. */
+void sim_run(void);
+
+/* Called by a node when its own status publish comes back from the broker */
+void sim_status_echo(struct mqtt_node *node, uint8_t index);
+
+#endif
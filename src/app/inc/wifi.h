@@ -10,8 +10,16 @@
 #ifndef WIFI_H
 #define WIFI_H
 
+struct wifi_iface_status;
+
 int8_t wifi_status(void);
+/* Quiet iface status query for periodic sampling, 0 on success */
+int wifi_sample(struct wifi_iface_status *status);
+/* Drop and redo the association with the saved credentials */
+void wifi_roam(void);
 int8_t wifi_init(char *SSID, char *PSK);
+void wifi_connect(char *SSID, char *PSK);
+void wifi_disconnect(void);
 
 #endif
 
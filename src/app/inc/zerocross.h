@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef ZEROCROSS_H
+#define ZEROCROSS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Switching quality, for logs and tests */
+struct zc_stats {
+    uint32_t releases;
+    /* Crossing minus predicted contact closure of the last release */
+    int32_t error_us;
+    uint32_t error_max_us;
+    /* Queue to pin write, last and worst */
+    uint32_t delay_us;
+    uint32_t delay_max_us;
+    uint32_t half_cycle_us;
+    bool locked;
+};
+
+/* Start tracking the zc0 mains zero-cross input. */
+int zc_init(void);
+
+/*
+ * Queue a relay write for the next zero crossing. Returns false when mains
+ * is not tracked (no lock yet or edges lost); the caller then writes the
+ * relay directly. Safe to call from ISRs.
+ */
+bool zc_queue(uint8_t index, bool state);
+
+void zc_stats_get(struct zc_stats *stats);
+
+#endif
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/adc.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/util.h>
+
+#include "energy.h"
+#include "gpio.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(energy, LOG_LEVEL_DBG);
+
+#define ZEPHYR_USER_NODE DT_PATH(zephyr_user)
+
+#if !DT_NODE_HAS_PROP(ZEPHYR_USER_NODE, io_channels)
+#error "CONFIG_APP_ENERGY_METER needs io-channels under /zephyr,user"
+#endif
+
+/* One current-sense input per relay, in relay order. */
+#define SENSE_SPEC(node_id, prop, idx) ADC_DT_SPEC_GET_BY_IDX(node_id, idx),
+
+static const struct adc_dt_spec sense[] = {
+    DT_FOREACH_PROP_ELEM(ZEPHYR_USER_NODE, io_channels, SENSE_SPEC)
+};
+
+#define SENSE_CHANNELS ARRAY_SIZE(sense)
+BUILD_ASSERT(ARRAY_SIZE(sense) <= maxRelays, "more current-sense inputs than relays");
+
+#define BLOCK_SAMPLES CONFIG_APP_ENERGY_BLOCK_SAMPLES
+#define BLOCK_US ((uint64_t)BLOCK_SAMPLES * CONFIG_APP_ENERGY_SAMPLE_US)
+
+BUILD_ASSERT(CONFIG_SYS_CLOCK_TICKS_PER_SEC * CONFIG_APP_ENERGY_SAMPLE_US >= USEC_PER_SEC,
+             "kernel tick is longer than the current-sense sampling interval");
+
+/*
+ * Ping-pong buffers: the sampling thread fills one while the other is
+ * reduced on the system work queue.
+ */
+static int16_t samples[2][BLOCK_SAMPLES * SENSE_CHANNELS];
+static uint8_t ready;
+/* Sampling ticks missed during the block in ready */
+static uint32_t missed;
+
+/*
+ * One single-channel sequence per input, read synchronously on each tick
+ * of sample_timer. Not every ADC driver supports multi-channel, repeated
+ * or async sequences (the ESP32 one supports none of them).
+ */
+static struct adc_sequence seq[SENSE_CHANNELS];
+
+static K_TIMER_DEFINE(sample_timer, NULL, NULL);
+
+/* Interval aggregates, shared with the MQTT thread. */
+static struct k_spinlock lock;
+static struct energy_acc interval[SENSE_CHANNELS];
+static uint64_t energy_uj[SENSE_CHANNELS];
+static int64_t next_publish;
+static atomic_t running;
+
+static K_THREAD_STACK_DEFINE(energy_stack, 1024);
+static struct k_thread energy_thread_data;
+
+static void energy_process(const int16_t *block) {
+    for (int ch = 0; ch < SENSE_CHANNELS; ch++) {
+        struct energy_acc acc;
+
+        energy_acc_reset(&acc);
+        energy_accumulate(&acc, &block[ch], BLOCK_SAMPLES, SENSE_CHANNELS);
+
+        /* uW * us / 1e6 = uJ */
+        uint64_t irms_ua = (uint64_t)energy_acc_rms(&acc) * CONFIG_APP_ENERGY_UA_PER_LSB;
+        uint64_t uj = irms_ua * CONFIG_APP_ENERGY_MAINS_VOLTS * BLOCK_US / USEC_PER_SEC;
+
+        k_spinlock_key_t key = k_spin_lock(&lock);
+        energy_acc_merge(&interval[ch], &acc);
+        energy_uj[ch] += uj;
+        k_spin_unlock(&lock, key);
+    }
+}
+
+static void energy_work_handler(struct k_work *work) {
+    if (missed > 0) {
+        LOG_WRN("Missed %u sampling ticks in one block", missed);
+    }
+    energy_process(samples[ready]);
+}
+
+static K_WORK_DEFINE(energy_work, energy_work_handler);
+
+/* One sample from every input, interleaved in relay order. */
+static int energy_sample(int16_t *dst) {
+    for (int ch = 0; ch < SENSE_CHANNELS; ch++) {
+        int ret;
+
+        seq[ch].buffer = &dst[ch];
+        ret = adc_read(sense[ch].dev, &seq[ch]);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static void energy_thread(void *p1, void *p2, void *p3) {
+    uint8_t cur = 0;
+    size_t n = 0;
+    uint32_t late = 0;
+    int ret = 0;
+
+    k_timer_start(&sample_timer, K_USEC(CONFIG_APP_ENERGY_SAMPLE_US),
+                  K_USEC(CONFIG_APP_ENERGY_SAMPLE_US));
+
+    while (ret == 0) {
+        /* A late read leaves a gap in the block rather than a burst of reads */
+        late += k_timer_status_sync(&sample_timer) - 1;
+
+        ret = energy_sample(&samples[cur][n * SENSE_CHANNELS]);
+
+        if (++n == BLOCK_SAMPLES) {
+            /* Hand this half over and fill the other one */
+            ready = cur;
+            missed = late;
+            late = 0;
+            cur ^= 1;
+            n = 0;
+            k_work_submit(&energy_work);
+        }
+    }
+
+    k_timer_stop(&sample_timer);
+    atomic_clear(&running);
+
+    LOG_ERR("Error %d: ADC sampling stopped, energy reports disabled", ret);
+}
+
+uint8_t energy_channels(void) {
+    return SENSE_CHANNELS;
+}
+
+int8_t energy_init(void) {
+    int ret;
+
+    for (int ch = 0; ch < SENSE_CHANNELS; ch++) {
+        if (!adc_is_ready_dt(&sense[ch])) {
+            LOG_ERR("Error: ADC device %s is not ready", sense[ch].dev->name);
+            return -ENODEV;
+        }
+
+        ret = adc_channel_setup_dt(&sense[ch]);
+        if (ret != 0) {
+            LOG_ERR("Error %d: failed to set up ADC channel %d", ret, sense[ch].channel_id);
+            return ret;
+        }
+
+        ret = adc_sequence_init_dt(&sense[ch], &seq[ch]);
+        if (ret != 0) {
+            return ret;
+        }
+
+        seq[ch].buffer_size = sizeof(samples[0][0]);
+        energy_acc_reset(&interval[ch]);
+    }
+
+    /* Fail here, not in the thread, if the driver cannot take these reads */
+    ret = energy_sample(samples[0]);
+    if (ret != 0) {
+        LOG_ERR("Error %d: ADC read failed", ret);
+        return ret;
+    }
+
+    next_publish = k_uptime_get() + CONFIG_APP_ENERGY_PUBLISH_SEC * MSEC_PER_SEC;
+    atomic_set(&running, 1);
+
+    k_thread_create(&energy_thread_data, energy_stack, K_THREAD_STACK_SIZEOF(energy_stack),
+                    energy_thread, NULL, NULL, NULL, K_PRIO_PREEMPT(5), 0, K_NO_WAIT);
+    k_thread_name_set(&energy_thread_data, "energy");
+
+    LOG_INF("Energy metering on %d channel(s)", SENSE_CHANNELS);
+
+    return 0;
+}
+
+int64_t energy_time_left(void) {
+    /* No samples, nothing worth publishing */
+    if (!atomic_get(&running)) {
+        return INT64_MAX;
+    }
+
+    return MAX(next_publish - k_uptime_get(), 0);
+}
+
+void energy_take(uint8_t index, struct energy_report *report) {
+    struct energy_acc acc;
+    uint64_t uj;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    acc = interval[index];
+    uj = energy_uj[index];
+    energy_acc_reset(&interval[index]);
+    k_spin_unlock(&lock, key);
+
+    report->irms_ma = (uint64_t)energy_acc_rms(&acc) * CONFIG_APP_ENERGY_UA_PER_LSB / 1000;
+    report->peak_ma = (uint64_t)energy_acc_peak(&acc) * CONFIG_APP_ENERGY_UA_PER_LSB / 1000;
+    /* 1 mWh = 3.6 J */
+    report->energy_mwh = uj / 3600000;
+
+    /* The whole bank is published together, move on once the last is taken */
+    if (index == SENSE_CHANNELS - 1) {
+        next_publish = k_uptime_get() + CONFIG_APP_ENERGY_PUBLISH_SEC * MSEC_PER_SEC;
+    }
+}
@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/util.h>
+
+#include "eventlog.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(event_log, LOG_LEVEL_DBG);
+
+#if !FIXED_PARTITION_EXISTS(eventlog_partition)
+#error "CONFIG_APP_EVENT_LOG needs an eventlog_partition in the devicetree"
+#endif
+
+#define REC_SIZE sizeof(struct event_record)
+#define SEQ_ERASED 0xffffffffU
+#define BATCH CONFIG_APP_EVENT_LOG_BATCH
+
+BUILD_ASSERT(sizeof(struct event_record) == 16, "records must tile flash sectors");
+
+/*
+ * The partition is used as a ring of erase sectors. Records are appended
+ * in RAM and written a batch at a time; a sector is erased just before the
+ * first write into it, which discards the oldest records.
+ */
+static const struct flash_area *fa;
+static uint32_t sector_size;
+static uint32_t ring_size;
+static uint32_t write_off;
+static uint32_t next_seq;
+static uint16_t boot;
+static bool ready;
+
+/* RAM batch, filled from any context */
+static struct k_spinlock lock;
+static struct event_record batch[BATCH];
+static size_t batch_count;
+static uint32_t dropped;
+
+/* Serializes flash access between the flush work and readers */
+static K_MUTEX_DEFINE(flash_lock);
+static struct event_record write_buf[BATCH];
+
+static void flush_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(flush_work, flush_handler);
+
+void event_log(uint8_t channel, uint8_t source, uint8_t state) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    if (batch_count == BATCH) {
+        dropped++;
+        k_spin_unlock(&lock, key);
+        return;
+    }
+
+    struct event_record *rec = &batch[batch_count++];
+
+    rec->seq = next_seq++;
+    rec->uptime_ms = k_uptime_get_32();
+    rec->boot = boot;
+    rec->channel = channel;
+    rec->source = source;
+    rec->state = state;
+    memset(rec->reserved, 0, sizeof(rec->reserved));
+
+    size_t count = batch_count;
+    k_spin_unlock(&lock, key);
+
+    /* A full batch goes out now, a partial one after the flush delay */
+    if (count == BATCH) {
+        k_work_reschedule(&flush_work, K_NO_WAIT);
+    } else if (count == 1) {
+        k_work_schedule(&flush_work, K_SECONDS(CONFIG_APP_EVENT_LOG_FLUSH_SEC));
+    }
+}
+
+static int ring_write(const struct event_record *recs, size_t count) {
+    int ret = 0;
+
+    for (size_t i = 0; i < count && ret == 0; ) {
+        if (write_off % sector_size == 0) {
+            ret = flash_area_erase(fa, write_off, sector_size);
+            if (ret != 0) {
+                break;
+            }
+        }
+
+        size_t room = (sector_size - write_off % sector_size) / REC_SIZE;
+        size_t n = MIN(room, count - i);
+
+        ret = flash_area_write(fa, write_off, &recs[i], n * REC_SIZE);
+        write_off = (write_off + n * REC_SIZE) % ring_size;
+        i += n;
+    }
+
+    return ret;
+}
+
+static void flush_handler(struct k_work *work) {
+    size_t count;
+    uint32_t lost;
+
+    k_mutex_lock(&flash_lock, K_FOREVER);
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    count = batch_count;
+    memcpy(write_buf, batch, count * REC_SIZE);
+    batch_count = 0;
+    lost = dropped;
+    dropped = 0;
+    k_spin_unlock(&lock, key);
+
+    if (ready && count > 0) {
+        int ret = ring_write(write_buf, count);
+        if (ret != 0) {
+            LOG_ERR("Error %d: failed to write %u events", ret, count);
+        }
+    }
+
+    k_mutex_unlock(&flash_lock);
+
+    if (lost > 0) {
+        LOG_ERR("Error: %u events dropped, batch full", lost);
+    }
+}
+
+int8_t event_log_init(void) {
+    struct flash_pages_info info;
+    struct event_record rec, last;
+    int32_t newest = -1;
+    int ret;
+
+    ret = flash_area_open(FIXED_PARTITION_ID(eventlog_partition), &fa);
+    if (ret != 0) {
+        LOG_ERR("Error %d: failed to open event log partition", ret);
+        return ret;
+    }
+
+    ret = flash_get_page_info_by_offs(flash_area_get_device(fa), fa->fa_off, &info);
+    if (ret != 0) {
+        LOG_ERR("Error %d: failed to get flash sector size", ret);
+        return ret;
+    }
+
+    sector_size = info.size;
+    ring_size = fa->fa_size / sector_size * sector_size;
+    if (ring_size < 2 * sector_size) {
+        LOG_ERR("Error: event log partition needs at least two sectors");
+        return -EINVAL;
+    }
+
+    /* An empty ring starts at zero, a second call rescans from scratch */
+    write_off = 0;
+    next_seq = 0;
+    boot = 0;
+
+    /* The newest sector starts with the highest sequence number */
+    for (uint32_t off = 0; off < ring_size; off += sector_size) {
+        flash_area_read(fa, off, &rec, REC_SIZE);
+        if (rec.seq != SEQ_ERASED && (newest < 0 || rec.seq >= next_seq)) {
+            newest = off;
+            next_seq = rec.seq;
+        }
+    }
+
+    if (newest >= 0) {
+        uint32_t off;
+
+        /* Continue after the last record written in that sector */
+        for (off = newest; off < newest + sector_size; off += REC_SIZE) {
+            flash_area_read(fa, off, &rec, REC_SIZE);
+            if (rec.seq == SEQ_ERASED) {
+                break;
+            }
+            last = rec;
+        }
+
+        write_off = off % ring_size;
+        next_seq = last.seq + 1;
+        boot = last.boot + 1;
+    }
+
+    ready = true;
+
+    LOG_INF("Event log: %u KiB ring, boot %u, next seq %u", ring_size / 1024, boot, next_seq);
+
+    return 0;
+}
+
+void event_log_flush(void) {
+    struct k_work_sync sync;
+
+    k_work_reschedule(&flush_work, K_NO_WAIT);
+    k_work_flush_delayable(&flush_work, &sync);
+}
+
+int8_t event_log_open(struct event_log_cursor *cursor, uint32_t from_seq) {
+    struct event_record rec;
+    uint32_t oldest;
+
+    if (!ready) {
+        return -ENODEV;
+    }
+
+    /* Make the RAM batch part of the upload */
+    event_log_flush();
+
+    k_mutex_lock(&flash_lock, K_FOREVER);
+
+    /* The sector due for erase next holds the oldest records */
+    oldest = ROUND_UP(write_off, sector_size) % ring_size;
+    flash_area_read(fa, oldest, &rec, REC_SIZE);
+    if (rec.seq == SEQ_ERASED) {
+        /* The ring has not wrapped yet */
+        oldest = 0;
+    }
+
+    cursor->off = oldest;
+    cursor->left = (write_off + ring_size - oldest) % ring_size;
+    if (cursor->left == 0 && rec.seq != SEQ_ERASED) {
+        cursor->left = ring_size;
+    }
+    cursor->from_seq = from_seq;
+
+    k_mutex_unlock(&flash_lock);
+
+    return 0;
+}
+
+int event_log_read(struct event_log_cursor *cursor, struct event_record *buf, size_t max) {
+    size_t n = 0;
+
+    k_mutex_lock(&flash_lock, K_FOREVER);
+
+    while (n < max && cursor->left > 0) {
+        size_t want = MIN(max - n, MIN(cursor->left, ring_size - cursor->off) / REC_SIZE);
+
+        if (flash_area_read(fa, cursor->off, &buf[n], want * REC_SIZE) != 0) {
+            cursor->left = 0;
+            break;
+        }
+
+        cursor->off = (cursor->off + want * REC_SIZE) % ring_size;
+        cursor->left -= want * REC_SIZE;
+
+        /* Drop erased sector tails and records the reader already has */
+        size_t kept = 0;
+
+        for (size_t i = 0; i < want; i++) {
+            if (buf[n + i].seq != SEQ_ERASED && buf[n + i].seq >= cursor->from_seq) {
+                buf[n + kept++] = buf[n + i];
+            }
+        }
+        n += kept;
+    }
+
+    k_mutex_unlock(&flash_lock);
+
+    return n;
+}
+
+uint16_t event_log_boot(void) {
+    return boot;
+}
@@ -4,13 +4,24 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <errno.h>
 #include <zephyr/kernel.h>
 #include <zephyr/device.h>
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/sys/util.h>
+#include <zephyr/posix/sys/eventfd.h>
 
 #include "gpio.h"
 #include "config.h"
+#ifdef CONFIG_APP_EVENT_LOG
+#include "eventlog.h"
+#endif
+#ifdef CONFIG_APP_SCHED
+#include "sched.h"
+#endif
+#ifdef CONFIG_APP_ZERO_CROSS
+#include "zerocross.h"
+#endif
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(gpio_config, LOG_LEVEL_DBG);
@@ -23,21 +34,79 @@ struct gpio_dt_spec buttons[maxButtons] = {
 
 static struct gpio_callback gpio_cb[maxButtons];
 
+/* Relay outputs as last written, output pins cannot always be read back */
+static atomic_t relay_states;
+
+/* Relays changed outside the MQTT loop that it has not published yet */
+static atomic_t relay_pending;
+
+/* Signalled on every button edge so the MQTT poll loop wakes up. */
+static int button_evt_fd = -1;
+
 /* Device Tree interface for Relay.  */
 struct gpio_dt_spec relays[maxRelays] = {
     GPIO_DT_SPEC_GET_OR(DT_ALIAS(rly0), gpios, {0}),
     GPIO_DT_SPEC_GET_OR(DT_ALIAS(rly1), gpios, {0})
 };
 
+void relay_set(uint8_t index, bool state, enum relay_source source) {
+    bool queued = false;
+
+#ifdef CONFIG_APP_ZERO_CROSS
+    queued = zc_queue(index, state);
+#endif
+    if (!queued) {
+        digital_write(&relays[index], state);
+    }
+    atomic_set_bit_to(&relay_states, index, state);
+
+#ifdef CONFIG_APP_EVENT_LOG
+    event_log(index, source, state);
+#endif
+#ifdef CONFIG_APP_SCHED
+    sched_relay_changed(index, state);
+#endif
+}
+
+bool relay_get(uint8_t index) {
+    return atomic_test_bit(&relay_states, index);
+}
+
+/* eventfd_write() may block on the fd table lock, so defer it out of the ISR */
+static void button_work_handler(struct k_work *work) {
+    eventfd_write(button_evt_fd, 1);
+}
+
+static K_WORK_DEFINE(button_work, button_work_handler);
+
+void relay_notify(uint8_t index) {
+    atomic_set_bit(&relay_pending, index);
+    if (button_evt_fd >= 0) {
+        k_work_submit(&button_work);
+    }
+}
+
+uint32_t relay_take_pending(void) {
+    return atomic_clear(&relay_pending);
+}
+
 /* Generic button handler */
 void button(const struct device *dev, struct gpio_callback *cb, uint32_t pins) {
     for (int i = 0; i<LIMIT; i++) {
         if (pins & BIT(buttons[i].pin)) {
             bool state = digital_read(&buttons[i]);
-            digital_write(&relays[i], state);
+            relay_set(i, state, RELAY_SRC_BUTTON);
             // LOG_INF("Button %d pressed, Relay %d set to %d", i, i, state);
         }
     }
+
+    if (button_evt_fd >= 0) {
+        k_work_submit(&button_work);
+    }
+}
+
+int gpio_event_fd(void) {
+    return button_evt_fd;
 }
 
 uint8_t pin_mode(struct gpio_dt_spec *user_gpio, uint32_t dir) {
@@ -55,6 +124,13 @@ uint8_t pin_mode(struct gpio_dt_spec *user_gpio, uint32_t dir) {
     }
 
     if (dir == GPIO_INPUT) {
+        if (button_evt_fd < 0) {
+            button_evt_fd = eventfd(0, EFD_NONBLOCK);
+            if (button_evt_fd < 0) {
+                LOG_ERR("Error %d: failed to create button eventfd", errno);
+            }
+        }
+
         ret = gpio_pin_interrupt_configure_dt(user_gpio, GPIO_INT_EDGE_BOTH);
         if (ret != 0) {
             LOG_ERR("Error %d: failed to configure interrupt on %s pin %d", ret, user_gpio->port->name, user_gpio->pin);
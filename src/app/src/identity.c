@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/drivers/hwinfo.h>
+#include <zephyr/settings/settings.h>
+
+#include "identity.h"
+#include "mqtt.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(identity, LOG_LEVEL_DBG);
+
+static char topic_prefix[APP_PREFIX_LEN] = CONFIG_APP_TOPIC_PREFIX;
+
+#ifdef CONFIG_SETTINGS
+static int identity_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg) {
+    const char *next;
+
+    if (settings_name_steq(name, "prefix", &next) && !next) {
+        if (len >= sizeof(topic_prefix)) {
+            return -EINVAL;
+        }
+
+        ssize_t rc = read_cb(cb_arg, topic_prefix, len);
+        if (rc < 0) {
+            return rc;
+        }
+
+        topic_prefix[rc] = '\0';
+        return 0;
+    }
+
+    return -ENOENT;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(app_identity, "app", NULL, identity_set, NULL, NULL);
+#endif
+
+int8_t node_identity(char *client_id, size_t id_len, char *prefix, size_t prefix_len) {
+#ifdef CONFIG_SETTINGS
+    int ret = settings_subsys_init();
+    if (ret == 0) {
+        /* Only our key, app/sched is loaded early by the scheduler */
+        settings_load_subtree("app/prefix");
+    } else {
+        LOG_ERR("Error %d: settings unavailable, using default prefix", ret);
+    }
+#endif
+
+    strncpy(prefix, topic_prefix, prefix_len - 1);
+    prefix[prefix_len - 1] = '\0';
+
+    strncpy(client_id, MQTT_CLIENTID, id_len - 1);
+    client_id[id_len - 1] = '\0';
+
+#ifdef CONFIG_HWINFO
+    uint8_t hwid[8];
+    ssize_t n = hwinfo_get_device_id(hwid, sizeof(hwid));
+    size_t base = strlen(MQTT_CLIENTID "-");
+
+    if (n > 0 && id_len > base + 2 * n) {
+        strcpy(client_id, MQTT_CLIENTID "-");
+        bin2hex(hwid, n, client_id + base, id_len - base);
+    } else {
+        LOG_ERR("Error %d: no hardware id, client id stays %s", (int)n, client_id);
+    }
+#endif
+
+    LOG_INF("Client id: %s, topic prefix: %s", client_id, prefix);
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/net/socket.h>
+
+#include "lan.h"
+#include "mqtt.h"
+#include "config.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(lan, LOG_LEVEL_DBG);
+
+int lan_open(uint16_t port) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    int fd;
+
+    fd = zsock_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0) {
+        LOG_ERR("Error %d: failed to create LAN control socket", errno);
+        return -errno;
+    }
+
+    if (zsock_bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        LOG_ERR("Error %d: failed to bind LAN control port %u", errno, port);
+        zsock_close(fd);
+        return -errno;
+    }
+
+    LOG_INF("LAN control on UDP port %u", port);
+
+    return fd;
+}
+
+void lan_serve(struct mqtt_node *node) {
+    struct lan_msg msg;
+    struct sockaddr_storage from;
+    socklen_t fromlen = sizeof(from);
+    ssize_t len;
+
+    while ((len = zsock_recvfrom(node->lan_fd, &msg, sizeof(msg), ZSOCK_MSG_DONTWAIT,
+                                 (struct sockaddr *)&from, &fromlen)) >= 0) {
+        if (len != sizeof(msg) || msg.magic[0] != LAN_MAGIC0 || msg.magic[1] != LAN_MAGIC1) {
+            fromlen = sizeof(from);
+            continue;
+        }
+
+        switch (msg.op) {
+        case LAN_OP_SET:
+            if (msg.channel >= LIMIT) {
+                break;
+            }
+            /* Relay first, the MQTT mirror follows in node_sync() */
+            node_set_relay(node, msg.channel, msg.state != 0, RELAY_SRC_LAN);
+            break;
+
+        case LAN_OP_GET:
+            break;
+
+        default:
+            fromlen = sizeof(from);
+            continue;
+        }
+
+        msg.op |= LAN_OP_REPLY;
+        msg.state = node_relay_mask(node);
+        zsock_sendto(node->lan_fd, &msg, sizeof(msg), 0, (struct sockaddr *)&from, fromlen);
+
+        fromlen = sizeof(from);
+    }
+}
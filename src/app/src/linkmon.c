@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/net/wifi_mgmt.h>
+#include <zephyr/posix/sys/eventfd.h>
+
+#include "linkmon.h"
+#include "wifi.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(linkmon, LOG_LEVEL_DBG);
+
+#define AVG_SAMPLES CONFIG_APP_LINK_AVG_SAMPLES
+
+static struct k_spinlock lock;
+
+/* RSSI moving average over the last AVG_SAMPLES samples */
+static int8_t rssi_ring[AVG_SAMPLES];
+static uint8_t ring_pos;
+static uint8_t ring_fill;
+static int16_t rssi_sum;
+
+/* Set below the low threshold, cleared above it plus hysteresis */
+static bool weak;
+
+/* Uptime when the open outage was detected, 0 if none */
+static int64_t detected_at;
+static int64_t next_report;
+static struct link_stats stats;
+
+static atomic_t teardown;
+static int link_evt_fd = -1;
+
+static void link_sample_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(sample_work, link_sample_handler);
+
+/* Called with lock held */
+static void ring_reset(void) {
+    ring_pos = 0;
+    ring_fill = 0;
+    rssi_sum = 0;
+}
+
+static void link_detect(const char *why) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    /* A drop during an open outage is the same outage */
+    if (detected_at == 0) {
+        detected_at = k_uptime_get();
+        stats.detections++;
+    }
+
+    k_spin_unlock(&lock, key);
+
+    LOG_WRN("Link degraded: %s, RSSI avg %d dBm", why, stats.rssi_avg);
+
+    atomic_set(&teardown, 1);
+    if (link_evt_fd >= 0) {
+        eventfd_write(link_evt_fd, 1);
+    }
+}
+
+static void link_sample_handler(struct k_work *work) {
+    struct wifi_iface_status status = {0};
+
+    /* Not associated: the disconnect event has already reported it */
+    if (wifi_sample(&status) == 0 && status.state >= WIFI_STATE_ASSOCIATED) {
+        k_spinlock_key_t key = k_spin_lock(&lock);
+        bool full;
+
+        if (ring_fill == AVG_SAMPLES) {
+            rssi_sum -= rssi_ring[ring_pos];
+        } else {
+            ring_fill++;
+        }
+        rssi_ring[ring_pos] = status.rssi;
+        rssi_sum += status.rssi;
+        ring_pos = (ring_pos + 1) % AVG_SAMPLES;
+        full = ring_fill == AVG_SAMPLES;
+
+        stats.rssi = status.rssi;
+        stats.rssi_avg = rssi_sum / ring_fill;
+        stats.channel = status.channel;
+        k_spin_unlock(&lock, key);
+
+        if (!weak && full && stats.rssi_avg < CONFIG_APP_LINK_RSSI_LOW) {
+            /* Act before the broker or TCP notice, then stay quiet until it recovers */
+            weak = true;
+            link_detect("weak signal");
+#ifdef CONFIG_APP_LINK_ROAM
+            wifi_roam();
+#endif
+        } else if (weak && stats.rssi_avg >= CONFIG_APP_LINK_RSSI_LOW + CONFIG_APP_LINK_RSSI_HYST) {
+            weak = false;
+        }
+    }
+
+    k_work_reschedule(&sample_work, K_MSEC(CONFIG_APP_LINK_SAMPLE_MS));
+}
+
+void link_lost(void) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    ring_reset();
+    k_spin_unlock(&lock, key);
+
+    link_detect("disconnected");
+}
+
+bool link_take_teardown(void) {
+    return atomic_clear(&teardown);
+}
+
+void link_mqtt_up(void) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    /* Teardown requests from before this connection are stale */
+    atomic_clear(&teardown);
+
+    if (detected_at != 0) {
+        stats.recovery_ms = k_uptime_get() - detected_at;
+        stats.recovery_max_ms = MAX(stats.recovery_max_ms, stats.recovery_ms);
+        detected_at = 0;
+        /* Report the outage right away */
+        next_report = 0;
+        LOG_INF("Link recovered in %u ms", stats.recovery_ms);
+    }
+
+    k_spin_unlock(&lock, key);
+}
+
+int64_t link_time_left(void) {
+    return MAX(next_report - k_uptime_get(), 0);
+}
+
+void link_stats_take(struct link_stats *out) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    *out = stats;
+    next_report = k_uptime_get() + CONFIG_APP_LINK_REPORT_SEC * MSEC_PER_SEC;
+
+    k_spin_unlock(&lock, key);
+}
+
+int link_monitor_init(void) {
+    link_evt_fd = eventfd(0, EFD_NONBLOCK);
+    if (link_evt_fd < 0) {
+        LOG_ERR("Error %d: failed to create link eventfd", errno);
+    }
+
+    next_report = k_uptime_get() + CONFIG_APP_LINK_REPORT_SEC * MSEC_PER_SEC;
+    k_work_reschedule(&sample_work, K_MSEC(CONFIG_APP_LINK_SAMPLE_MS));
+
+    return link_evt_fd;
+}
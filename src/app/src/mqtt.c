@@ -7,6 +7,8 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <errno.h>
 #include <zephyr/kernel.h>
 #include <zephyr/net/socket.h>
@@ -14,62 +16,233 @@
 #include <zephyr/device.h>
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/random/random.h>
+#include <zephyr/posix/sys/eventfd.h>
 #include <zephyr/logging/log.h>
 
 #include "mqtt.h"
 #include "gpio.h"
 #include "config.h"
+#ifdef CONFIG_APP_ENERGY_METER
+#include "energy.h"
+#endif
+#ifdef CONFIG_APP_SIM
+#include "sim.h"
+#endif
+#ifdef CONFIG_APP_EVENT_LOG
+#include "eventlog.h"
+#endif
+#ifdef CONFIG_APP_LAN_CONTROL
+#include "lan.h"
+#endif
+#ifdef CONFIG_APP_SCHED
+#include "sched.h"
+#endif
+#ifdef CONFIG_APP_LINK_MONITOR
+#include "linkmon.h"
+#endif
 
 LOG_MODULE_REGISTER(mqtt_app, LOG_LEVEL_DBG);
 
 
+#define PINGRESP_MSECS (CONFIG_APP_PINGRESP_TIMEOUT_SEC * MSEC_PER_SEC)
+
 #define SUCCESS_OR_EXIT(rc) { if (rc != 0) { return 1; } }
 #define SUCCESS_OR_BREAK(rc) { if (rc != 0) { break; } }
 
-/* Publish Topic list*/
-char *pub_topics[] = {"/room2/status/outlet1", "/room2/status/outlet2"};
-size_t size_of_pub_topics = ARRAY_SIZE(pub_topics);
+/*
+ * Ping interval currently in use is node->keepalive_sec. It starts at the
+ * keepalive announced in CONNECT and shrinks when an idle link dies (NAT or
+ * broker dropped us before the next ping), then creeps back up while pings
+ * succeed. The broker only cares that we ping at least as often as announced,
+ * so the interval can be changed mid-session.
+ */
+
+#ifdef CONFIG_APP_WAKEUP_STATS
+static uint32_t wakeups;
+static int64_t wakeups_since;
+#endif
+
+/* <prefix>/<kind>/outletN, or <prefix>/<kind> for node-wide topics (index < 0) */
+static void topic_init(struct app_topic *topic, const char *prefix, const char *kind, int index)
+{
+	int len;
+
+	if (index < 0) {
+		len = snprintk(topic->name, sizeof(topic->name), "%s/%s", prefix, kind);
+	} else {
+		len = snprintk(topic->name, sizeof(topic->name), "%s/%s/outlet%d",
+			       prefix, kind, index + 1);
+	}
+
+	topic->len = MIN(len, sizeof(topic->name) - 1);
+}
+
+void mqtt_node_init(struct mqtt_node *node, const char *client_id, const char *prefix, int event_fd)
+{
+	memset(node, 0, sizeof(*node));
+
+	strncpy(node->client_id, client_id, sizeof(node->client_id) - 1);
+	node->event_fd = event_fd;
+	node->lan_fd = -1;
+	node->link_fd = -1;
+	node->keepalive_sec = CONFIG_MQTT_KEEPALIVE;
+	node->prefix_len = strlen(prefix);
+
+	/* Every topic is formatted here once, never per message */
+	for (int index = 0; index < LIMIT; index++) {
+		topic_init(&node->pub_topics[index], prefix, "status", index);
+		topic_init(&node->sub_topics[index], prefix, "set", index);
+#ifdef CONFIG_APP_ENERGY_METER
+		topic_init(&node->energy_topics[index], prefix, "energy", index);
+#endif
+	}
 
-/* Subscribed Topic list*/
-char *sub_topics[] = {"/room2/set/outlet1", "/room2/set/outlet2"};
-size_t size_of_sub_topics = ARRAY_SIZE(sub_topics);
+#ifdef CONFIG_APP_EVENT_LOG
+	topic_init(&node->log_get_topic, prefix, "log/get", -1);
+	topic_init(&node->log_data_topic, prefix, "log/data", -1);
+#endif
+#ifdef CONFIG_APP_SCHED
+	topic_init(&node->sched_topic, prefix, "sched/set", -1);
+#endif
+#ifdef CONFIG_APP_LINK_MONITOR
+	topic_init(&node->link_topic, prefix, "metrics/link", -1);
+#endif
+}
 
-/* Buffers for MQTT client. */
-static uint8_t rx_buffer[APP_MQTT_BUFFER_SIZE];
-static uint8_t tx_buffer[APP_MQTT_BUFFER_SIZE];
+/* All node topics share the prefix, so it is compared only once */
+static bool topic_has_prefix(const struct mqtt_node *node, const struct mqtt_utf8 *topic)
+{
+	return topic->size > node->prefix_len &&
+	       !memcmp(topic->utf8, node->pub_topics[0].name, node->prefix_len);
+}
 
-/* The mqtt client struct */
-struct mqtt_client client_ctx;
+/* Index of the matching topic in list, by length then suffix; -1 if none */
+static int match_topic(const struct mqtt_node *node, const struct mqtt_utf8 *topic,
+		       const struct app_topic *list, int count)
+{
+	size_t plen = node->prefix_len;
 
-/* MQTT Broker details. */
-static struct sockaddr_storage broker;
+	for (int index = 0; index < count; index++) {
+		if (topic->size == list[index].len &&
+		    !memcmp(topic->utf8 + plen, list[index].name + plen, topic->size - plen)) {
+			return index;
+		}
+	}
 
-static struct zsock_pollfd fds[1];
-static int nfds;
+	return -1;
+}
 
-bool connected;
+/* Button and relay bank behind a node, virtual when simulating a fleet */
+static bool node_button(struct mqtt_node *node, uint8_t index)
+{
+#ifdef CONFIG_APP_SIM
+	return node->sim_buttons[index];
+#else
+	return digital_read(&buttons[index]);
+#endif
+}
+
+static void node_relay(struct mqtt_node *node, uint8_t index, bool state,
+		       enum relay_source source)
+{
+#ifdef CONFIG_APP_SIM
+	node->sim_relays[index] = state;
+#else
+	relay_set(index, state, source);
+#endif
+}
+
+static bool node_relay_state(struct mqtt_node *node, uint8_t index)
+{
+#ifdef CONFIG_APP_SIM
+	return node->sim_relays[index];
+#else
+	return relay_get(index);
+#endif
+}
+
+uint32_t node_relay_mask(struct mqtt_node *node)
+{
+	uint32_t mask = 0;
+
+	for (int index = 0; index < LIMIT; index++) {
+		mask |= node_relay_state(node, index) << index;
+	}
+
+	return mask;
+}
+
+/*
+ * Commands from MQTT and the LAN fast path both land here. The relay is
+ * driven at once and node_sync() publishes the new state afterwards, so
+ * the broker never sits between a command and the relay.
+ */
+void node_set_relay(struct mqtt_node *node, uint8_t index, bool state,
+		    enum relay_source source)
+{
+	node_relay(node, index, state, source);
+	node->relay_dirty |= BIT(index);
+}
 
-static void prepare_fds(struct mqtt_client *client)
+static void node_sync(struct mqtt_node *node)
 {
+	while (node->relay_dirty && node->connected) {
+		uint8_t index = find_lsb_set(node->relay_dirty) - 1;
+
+		node->relay_dirty &= ~BIT(index);
+		publish(node, &node->pub_topics[index],
+			node_relay_state(node, index) ? "1" : "0");
+	}
+}
+
+static void prepare_fds(struct mqtt_node *node)
+{
+	struct mqtt_client *client = &node->client;
+
 	if (client->transport.type == MQTT_TRANSPORT_NON_SECURE) {
-		fds[0].fd = client->transport.tcp.sock;
+		node->fds[FDS_BROKER].fd = client->transport.tcp.sock;
 	}
 
-	fds[0].events = ZSOCK_POLLIN;
-	nfds = 1;
+	node->fds[FDS_BROKER].events = ZSOCK_POLLIN;
+	node->fds[FDS_LAN].fd = node->lan_fd;
+	node->fds[FDS_LAN].events = ZSOCK_POLLIN;
+	node->fds[FDS_EVENT].fd = node->event_fd;
+	node->fds[FDS_EVENT].events = ZSOCK_POLLIN;
+	node->fds[FDS_LINK].fd = node->link_fd;
+	node->fds[FDS_LINK].events = ZSOCK_POLLIN;
+	node->nfds = FDS_COUNT;
 }
 
-static void clear_fds(void)
+void mqtt_node_idle(struct mqtt_node *node, int timeout)
 {
-	nfds = 0;
+	int64_t end = k_uptime_get() + timeout;
+
+#ifdef CONFIG_APP_LAN_CONTROL
+	struct zsock_pollfd pfd = { .fd = node->lan_fd, .events = ZSOCK_POLLIN };
+	int64_t left;
+
+	/* The broker may be down, LAN control must keep working regardless */
+	while (node->lan_fd >= 0 && (left = end - k_uptime_get()) > 0) {
+		if (zsock_poll(&pfd, 1, (int)left) > 0) {
+			lan_serve(node);
+		}
+	}
+#endif
+
+	k_sleep(K_TIMEOUT_ABS_MS(end));
 }
 
-static int wait(int timeout)
+static void clear_fds(struct mqtt_node *node)
+{
+	node->nfds = 0;
+}
+
+static int wait(struct mqtt_node *node, int timeout)
 {
 	int ret = 0;
 
-	if (nfds > 0) {
-		ret = zsock_poll(fds, nfds, timeout);
+	if (node->nfds > 0) {
+		ret = zsock_poll(node->fds, node->nfds, timeout);
 		if (ret < 0) {
 			LOG_ERR("poll error: %d", errno);
 		}
@@ -81,8 +254,13 @@ static int wait(int timeout)
 void mqtt_evt_handler(struct mqtt_client *const client,
 		      const struct mqtt_evt *evt)
 {
+	struct mqtt_node *node = CONTAINER_OF(client, struct mqtt_node, client);
 	int err;
 
+	if (evt->type != MQTT_EVT_DISCONNECT) {
+		node->last_activity = k_uptime_get();
+	}
+
 	switch (evt->type) {
 	case MQTT_EVT_CONNACK:
 		if (evt->result != 0) {
@@ -90,16 +268,19 @@ void mqtt_evt_handler(struct mqtt_client *const client,
 			break;
 		}
 
-		connected = true;
+		node->connected = true;
 		LOG_INF("MQTT client connected!");
+#ifdef CONFIG_APP_LINK_MONITOR
+		link_mqtt_up();
+#endif
 
 		break;
 
 	case MQTT_EVT_DISCONNECT:
 		LOG_INF("MQTT client disconnected %d", evt->result);
 
-		connected = false;
-		clear_fds();
+		node->connected = false;
+		clear_fds(node);
 
 		break;
 
@@ -154,41 +335,87 @@ void mqtt_evt_handler(struct mqtt_client *const client,
 
 	case MQTT_EVT_PINGRESP:
 		LOG_INF("PINGRESP packet");
+		node->ping_sent = 0;
+
+		if (node->keepalive_sec < CONFIG_MQTT_KEEPALIVE &&
+		    ++node->keepalive_ok >= CONFIG_APP_KEEPALIVE_GROW_AFTER) {
+			node->keepalive_sec = MIN(node->keepalive_sec + CONFIG_APP_KEEPALIVE_STEP_SEC,
+						  CONFIG_MQTT_KEEPALIVE);
+			node->keepalive_ok = 0;
+			client->keepalive = node->keepalive_sec;
+			LOG_INF("Keepalive raised to %u s", node->keepalive_sec);
+		}
 		break;
 
 	case MQTT_EVT_PUBLISH:
 		struct mqtt_puback_param puback;
-		uint8_t data[2];
-		char* subTopic = (uint8_t*)evt->param.publish.message.topic.topic.utf8;
+		/* Large enough for "1"/"0", a log/get sequence and a schedule command */
+		uint8_t data[48];
+		const struct mqtt_utf8 *topic = &evt->param.publish.message.topic.topic;
 		int len = evt->param.publish.message.payload.len;
-		int bytes_read;
+		int bytes_read, index;
+		size_t used = 0;
+		bool too_long = len > sizeof(data) - 1;
 		
 		LOG_INF("MQTT publish received %d, %d bytes", evt->result, len);
-		LOG_INF("MQTT publish received topic: %s", subTopic);
+		LOG_INF("MQTT publish received topic: %.*s", topic->size, topic->utf8);
 		LOG_INF(" id: %d, qos: %d", evt->param.publish.message_id,
 			evt->param.publish.message.topic.qos);
 
 		while (len) {
-			bytes_read = mqtt_read_publish_payload(&client_ctx,
-					data,
-					len >= sizeof(data) - 1 ?
-					sizeof(data) - 1 : len);
-			if (bytes_read < 0 && bytes_read != -EAGAIN) {
+			bytes_read = mqtt_read_publish_payload(client,
+					data + used,
+					MIN(len, sizeof(data) - 1 - used));
+			if (bytes_read == -EAGAIN) {
+				continue;
+			}
+			if (bytes_read < 0) {
 				LOG_ERR("failure to read payload");
 				break;
 			}
 
-			data[bytes_read] = '\0';
 			len -= bytes_read;
+			used += bytes_read;
+
+			/* Oversized payloads are only drained, never parsed */
+			if (too_long && used == sizeof(data) - 1) {
+				used = 0;
+			}
 		}
 
-		/* Toggle Relay State when payload is recieved from Home Assistant*/
-		for(int index=0; index<LIMIT; index++)
-			if (!strcmp(subTopic, sub_topics[index])) 
-				sub_relay_state(&relays[index], data, pub_topics[index]);
+		/* Empty payloads (e.g. a bare log/get) read as "" */
+		data[too_long ? 0 : used] = '\0';
+
+#ifdef CONFIG_APP_SIM
+		node->rx++;
+#endif
+
+		if (!topic_has_prefix(node, topic)) {
+			LOG_INF("Topic outside our prefix, ignored");
+		} else if (too_long) {
+			LOG_WRN("Payload longer than %d bytes, ignored", (int)sizeof(data) - 1);
+		} else if ((index = match_topic(node, topic, node->sub_topics, LIMIT)) >= 0) {
+			/* Toggle Relay State when payload is recieved from Home Assistant*/
+			sub_relay_state(node, index, data);
+#ifdef CONFIG_APP_EVENT_LOG
+		} else if (match_topic(node, topic, &node->log_get_topic, 1) == 0) {
+			/* Bulk upload of the event history, from the given sequence on */
+			node->log_upload = event_log_open(&node->log_cursor,
+							  strtoul((char *)data, NULL, 10)) == 0;
+#endif
+#ifdef CONFIG_APP_SCHED
+		} else if (match_topic(node, topic, &node->sched_topic, 1) == 0) {
+			sched_command((char *)data);
+#endif
+#ifdef CONFIG_APP_SIM
+		} else if ((index = match_topic(node, topic, node->pub_topics, LIMIT)) >= 0) {
+			/* Our own status coming back through the broker */
+			sim_status_echo(node, index);
+#endif
+		}
 
 		puback.message_id = evt->param.publish.message_id;
-		mqtt_publish_qos1_ack(&client_ctx, &puback);
+		mqtt_publish_qos1_ack(client, &puback);
 		break;
 
 	default:
@@ -196,26 +423,44 @@ void mqtt_evt_handler(struct mqtt_client *const client,
 	}
 }
 
-int subscribe(struct mqtt_client *client, char *sub_topics[], size_t size_of_pub_topics)
+static void sub_add(struct mqtt_topic *topics, size_t *count, const struct app_topic *topic)
+{
+	topics[*count].topic.utf8 = topic->name;
+	topics[*count].topic.size = topic->len;
+	topics[*count].qos = MQTT_QOS_0_AT_MOST_ONCE;
+	(*count)++;
+}
+
+int subscribe(struct mqtt_node *node)
 {
 	int ret;
 
-	struct mqtt_topic topics[size_of_pub_topics];
+	struct mqtt_topic topics[2 * LIMIT + 2];
 	struct mqtt_subscription_list sub;
-
-	for (size_t i = 0; i < ARRAY_SIZE(topics); ++i) {
-        topics[i].topic.utf8 = sub_topics[i];
-        topics[i].topic.size = strlen(sub_topics[i]);
-        topics[i].qos = MQTT_QOS_0_AT_MOST_ONCE;
+	size_t count = 0;
+
+	for (size_t i = 0; i < LIMIT; ++i) {
+        sub_add(topics, &count, &node->sub_topics[i]);
+#ifdef CONFIG_APP_SIM
+        /* Echo of our own status, to time the round trip */
+        sub_add(topics, &count, &node->pub_topics[i]);
+#endif
     }
 
+#ifdef CONFIG_APP_EVENT_LOG
+	sub_add(topics, &count, &node->log_get_topic);
+#endif
+#ifdef CONFIG_APP_SCHED
+	sub_add(topics, &count, &node->sched_topic);
+#endif
+
 	sub.list = topics;
-	sub.list_count = size_of_pub_topics;
+	sub.list_count = count;
 	sub.message_id = sys_rand32_get();
 
 	LOG_INF("Subscribing to %hu topic(s)", sub.list_count);
 
-	ret = mqtt_subscribe(client, &sub);
+	ret = mqtt_subscribe(&node->client, &sub);
 	if (ret != 0) {
 		LOG_ERR("Failed to subscribe to topics: %d", ret);
 	}
@@ -223,22 +468,30 @@ int subscribe(struct mqtt_client *client, char *sub_topics[], size_t size_of_pub
 	return ret;
 }
 
-int publish(struct mqtt_client *client, char *pub_topics, char *payload)
+int publish_raw(struct mqtt_node *node, const struct app_topic *topic,
+		const uint8_t *payload, size_t len)
 {
 	struct mqtt_publish_param param;
 
+#ifdef CONFIG_APP_SIM
+	node->tx++;
+#endif
+
 	param.message.topic.qos = 0;
-	param.message.topic.topic.utf8 = (uint8_t *)pub_topics;
-	param.message.topic.topic.size =
-			strlen(param.message.topic.topic.utf8);
-	param.message.payload.data = payload;
-	param.message.payload.len =
-			strlen(param.message.payload.data);
+	param.message.topic.topic.utf8 = (uint8_t *)topic->name;
+	param.message.topic.topic.size = topic->len;
+	param.message.payload.data = (uint8_t *)payload;
+	param.message.payload.len = len;
 	param.message_id = sys_rand32_get();
 	param.dup_flag = 0U;
 	param.retain_flag = 0U;
 
-	return mqtt_publish(client, &param);
+	return mqtt_publish(&node->client, &param);
+}
+
+int publish(struct mqtt_node *node, const struct app_topic *topic, char *payload)
+{
+	return publish_raw(node, topic, (uint8_t *)payload, strlen(payload));
 }
 
 #define RC_STR(rc) ((rc) == 0 ? "OK" : "ERROR")
@@ -246,158 +499,371 @@ int publish(struct mqtt_client *client, char *pub_topics, char *payload)
 #define PRINT_RESULT(func, rc) \
 	LOG_INF("%s: %d <%s>", (func), rc, RC_STR(rc))
 
-static void broker_init(void)
+static void broker_init(struct mqtt_node *node)
 {
-	struct sockaddr_in *broker4 = (struct sockaddr_in *)&broker;
+	struct sockaddr_in *broker4 = (struct sockaddr_in *)&node->broker;
 
 	broker4->sin_family = AF_INET;
 	broker4->sin_port = htons(SERVER_PORT);
 	zsock_inet_pton(AF_INET, SERVER_ADDR, &broker4->sin_addr);
 }
 
-static void client_init(struct mqtt_client *client)
+static void client_init(struct mqtt_node *node)
 {
+	struct mqtt_client *client = &node->client;
+
 	mqtt_client_init(client);
 
-	broker_init();
+	broker_init(node);
 
 	/* MQTT client configuration */
-	client->broker = &broker;
+	client->broker = &node->broker;
 	client->evt_cb = mqtt_evt_handler;
-	client->client_id.utf8 = (uint8_t *)MQTT_CLIENTID;
-	client->client_id.size = strlen(MQTT_CLIENTID);
+	client->client_id.utf8 = (uint8_t *)node->client_id;
+	client->client_id.size = strlen(node->client_id);
 	client->password = NULL;
 	client->user_name = NULL;
 	client->protocol_version = MQTT_VERSION_3_1_1;
+	client->keepalive = CONFIG_MQTT_KEEPALIVE;
 
 	/* MQTT buffers configuration */
-	client->rx_buf = rx_buffer;
-	client->rx_buf_size = sizeof(rx_buffer);
-	client->tx_buf = tx_buffer;
-	client->tx_buf_size = sizeof(tx_buffer);
+	client->rx_buf = node->rx_buffer;
+	client->rx_buf_size = sizeof(node->rx_buffer);
+	client->tx_buf = node->tx_buffer;
+	client->tx_buf_size = sizeof(node->tx_buffer);
 }
 
 /* In this routine we block until the connected variable is 1 */
-int try_to_connect(struct mqtt_client *client)
+int try_to_connect(struct mqtt_node *node)
 {
+	struct mqtt_client *client = &node->client;
 	int rc, i = 0;
 
-	while (i++ < APP_CONNECT_TRIES && !connected) {
+	while (i++ < APP_CONNECT_TRIES && !node->connected) {
 
-		client_init(client);
+		client_init(node);
 
 		rc = mqtt_connect(client);
 		if (rc != 0) {
 			PRINT_RESULT("mqtt_connect", rc);
-			k_sleep(K_MSEC(APP_SLEEP_MSECS));
+			mqtt_node_idle(node, APP_SLEEP_MSECS);
 			continue;
 		}
 
-		prepare_fds(client);
+		prepare_fds(node);
+
+		/* Only the broker socket and LAN commands matter until CONNACK */
+		int64_t end = k_uptime_get() + APP_CONNECT_TIMEOUT_MS;
+		int64_t left;
 
-		if (wait(APP_CONNECT_TIMEOUT_MS)) {
-			mqtt_input(client);
+		while (!node->connected && (left = end - k_uptime_get()) > 0) {
+			if (zsock_poll(node->fds, FDS_EVENT, (int)left) <= 0) {
+				break;
+			}
+#ifdef CONFIG_APP_LAN_CONTROL
+			if (node->fds[FDS_LAN].revents & ZSOCK_POLLIN) {
+				lan_serve(node);
+			}
+#endif
+			if (node->fds[FDS_BROKER].revents &&
+			    mqtt_input(client) != 0) {
+				break;
+			}
 		}
 
-		if (!connected) {
+		if (!node->connected) {
 			mqtt_abort(client);
 		}
 	}
 
-	if (connected) {
+	if (node->connected) {
+		/* Announced keepalive stays at the maximum, ping at the learnt rate */
+		client->keepalive = node->keepalive_sec;
+		node->last_activity = k_uptime_get();
+		node->ping_sent = 0;
 		return 0;
 	}
 
 	return -EINVAL;
 }
 
-int process_mqtt_and_sleep(struct mqtt_client *client, int timeout)
+/*
+ * The link died while idle: ping faster than the interval in use. The idle
+ * time itself is no guide, it is only known once the unanswered ping has
+ * timed out and so always exceeds the interval.
+ */
+static void keepalive_shrink(struct mqtt_node *node)
+{
+	int64_t idle_sec = (k_uptime_get() - node->last_activity) / MSEC_PER_SEC;
+	uint16_t shorter = MAX(node->keepalive_sec * 3 / 4, CONFIG_APP_KEEPALIVE_MIN_SEC);
+
+	node->keepalive_ok = 0;
+
+	/* A drop right after traffic says nothing about idle timeouts */
+	if (idle_sec >= node->keepalive_sec / 2 && shorter < node->keepalive_sec) {
+		node->keepalive_sec = shorter;
+		LOG_INF("Keepalive lowered to %u s", node->keepalive_sec);
+	}
+}
+
+#ifdef CONFIG_APP_ENERGY_METER
+/* Publish RMS/peak current and accumulated energy, never raw samples */
+static void pub_energy(struct mqtt_node *node)
+{
+	struct energy_report report;
+	char payload[64];
+
+	for (uint8_t index = 0; index < energy_channels(); index++) {
+		energy_take(index, &report);
+
+		snprintk(payload, sizeof(payload),
+			 "{\"irms_ma\":%u,\"peak_ma\":%u,\"energy_mwh\":%llu}",
+			 report.irms_ma, report.peak_ma,
+			 (unsigned long long)report.energy_mwh);
+		publish(node, &node->energy_topics[index], payload);
+	}
+}
+#endif
+
+#ifdef CONFIG_APP_LINK_MONITOR
+/* RSSI and outage recovery times */
+static void pub_link(struct mqtt_node *node)
+{
+	struct link_stats stats;
+	char payload[128];
+
+	link_stats_take(&stats);
+
+	snprintk(payload, sizeof(payload),
+		 "{\"rssi\":%d,\"rssi_avg\":%d,\"channel\":%u,\"detections\":%u,"
+		 "\"recovery_ms\":%u,\"recovery_max_ms\":%u}",
+		 stats.rssi, stats.rssi_avg, stats.channel, stats.detections,
+		 stats.recovery_ms, stats.recovery_max_ms);
+	publish(node, &node->link_topic, payload);
+}
+#endif
+
+#ifdef CONFIG_APP_EVENT_LOG
+/*
+ * Send one chunk of the event history per loop pass, so broker input is
+ * still served during a long upload. An empty chunk ends the upload.
+ */
+static void pub_event_log(struct mqtt_node *node)
 {
-	int64_t remaining = timeout;
-	int64_t start_time = k_uptime_get();
+	static struct {
+		struct event_chunk_hdr hdr;
+		struct event_record recs[CONFIG_APP_EVENT_LOG_CHUNK];
+	} __packed chunk;
+	int count = event_log_read(&node->log_cursor, chunk.recs, ARRAY_SIZE(chunk.recs));
+
+	chunk.hdr.boot = event_log_boot();
+	chunk.hdr.count = count;
+	chunk.hdr.uptime_ms = k_uptime_get_32();
+
+	publish_raw(node, &node->log_data_topic, (uint8_t *)&chunk,
+		    sizeof(chunk.hdr) + count * sizeof(chunk.recs[0]));
+
+	if (count == 0) {
+		node->log_upload = false;
+	}
+}
+#endif
+
+/* Milliseconds until the next timed job, -1 if there is none */
+static int next_deadline(struct mqtt_node *node)
+{
+	uint64_t left = mqtt_keepalive_time_left(&node->client);
+
+	if (node->ping_sent) {
+		left = MIN(left, (uint64_t)MAX(node->ping_sent + PINGRESP_MSECS - k_uptime_get(), 0));
+	}
+
+#ifdef CONFIG_APP_EVENT_LOG
+	if (node->log_upload) {
+		return 0;
+	}
+#endif
+
+#ifdef CONFIG_APP_ENERGY_METER
+	left = MIN(left, (uint64_t)energy_time_left());
+#endif
+
+#ifdef CONFIG_APP_LINK_MONITOR
+	left = MIN(left, (uint64_t)link_time_left());
+#endif
+
+	return left > INT_MAX ? -1 : (int)left;
+}
+
+/*
+ * Sleep until something needs doing: broker data, a button edge or the next
+ * timed job (keepalive ping or its PINGRESP deadline, energy report). QoS 0
+ * publishes are never retransmitted, so there are no retransmit deadlines.
+ */
+int process_mqtt_and_sleep(struct mqtt_node *node)
+{
+	struct mqtt_client *client = &node->client;
+	int timeout = next_deadline(node);
 	int rc;
 
-	while (remaining > 0 && connected) {
-		if (wait(remaining)) {
-			rc = mqtt_input(client);
-			if (rc != 0) {
-				PRINT_RESULT("mqtt_input", rc);
-				return rc;
-			}
+	rc = wait(node, timeout);
+	if (rc < 0) {
+		return rc;
+	}
+
+#ifdef CONFIG_APP_WAKEUP_STATS
+	wakeups++;
+	if (k_uptime_get() - wakeups_since >= 60 * MSEC_PER_SEC) {
+		LOG_INF("Wakeups/min: %u, keepalive: %u s", wakeups, node->keepalive_sec);
+		wakeups = 0;
+		wakeups_since = k_uptime_get();
+	}
+#endif
+
+#ifdef CONFIG_APP_LAN_CONTROL
+	/* Fast path first: actuate before any broker traffic is handled */
+	if (node->fds[FDS_LAN].revents & ZSOCK_POLLIN) {
+		lan_serve(node);
+	}
+#endif
+
+#ifdef CONFIG_APP_LINK_MONITOR
+	if (node->fds[FDS_LINK].revents & ZSOCK_POLLIN) {
+		eventfd_t events;
+
+		eventfd_read(node->link_fd, &events);
+
+		/* Leave cleanly now rather than after a TCP or broker timeout */
+		if (link_take_teardown()) {
+			LOG_WRN("Link degraded, reconnecting to the broker");
+			mqtt_disconnect(client);
+			return -ENETDOWN;
 		}
+	}
+#endif
 
-		rc = mqtt_live(client);
-		if (rc != 0 && rc != -EAGAIN) {
-			PRINT_RESULT("mqtt_live", rc);
+	if (node->fds[FDS_BROKER].revents & (ZSOCK_POLLIN | ZSOCK_POLLERR | ZSOCK_POLLHUP)) {
+		rc = mqtt_input(client);
+		if (rc != 0) {
+			PRINT_RESULT("mqtt_input", rc);
 			return rc;
-		} else if (rc == 0) {
-			rc = mqtt_input(client);
-			if (rc != 0) {
-				PRINT_RESULT("mqtt_input", rc);
-				return rc;
-			}
 		}
+	}
+
+	if (node->fds[FDS_EVENT].revents & ZSOCK_POLLIN) {
+		eventfd_t events;
+
+		eventfd_read(node->event_fd, &events);
+
+		for (int index = 0; index < LIMIT; index++)
+			pub_switch_state(node, index);
+
+		/* Relays switched by schedules, published by node_sync() below */
+		node->relay_dirty |= relay_take_pending();
+	}
 
-		remaining = timeout + start_time - k_uptime_get();
+	/* Mirror relay changes made by commands */
+	node_sync(node);
+
+#ifdef CONFIG_APP_ENERGY_METER
+	if (energy_time_left() == 0) {
+		pub_energy(node);
+	}
+#endif
+
+#ifdef CONFIG_APP_EVENT_LOG
+	if (node->log_upload) {
+		pub_event_log(node);
+	}
+#endif
+
+#ifdef CONFIG_APP_LINK_MONITOR
+	if (link_time_left() == 0) {
+		pub_link(node);
+	}
+#endif
+
+	/* A silently dropped link fails here, long before TCP gives up */
+	if (node->ping_sent && k_uptime_get() - node->ping_sent >= PINGRESP_MSECS) {
+		LOG_WRN("No PINGRESP within %d s", CONFIG_APP_PINGRESP_TIMEOUT_SEC);
+		return -ETIMEDOUT;
+	}
+
+	rc = mqtt_live(client);
+	if (rc != 0 && rc != -EAGAIN) {
+		PRINT_RESULT("mqtt_live", rc);
+		return rc;
+	}
+
+	if (client->unacked_ping > 0 && node->ping_sent == 0) {
+		node->ping_sent = k_uptime_get();
 	}
 
 	return 0;
 }
 
 /*Publish Physical Switch State*/
-int8_t pub_switch_state(struct gpio_dt_spec *button, uint8_t index, char *pub_topics){
-    int8_t rc;
-    bool currentState = digital_read(button);
-    static bool previousState[32] = {false};
+int8_t pub_switch_state(struct mqtt_node *node, uint8_t index){
+    int8_t rc = 0;
+    bool currentState = node_button(node, index);
 
     // Check if the state has changed
-	if(previousState[index] ^ currentState){
-		if(currentState) rc = publish(&client_ctx, pub_topics, "1");
-		else rc = publish(&client_ctx, pub_topics, "0");
+	if(node->previous_state[index] ^ currentState){
+		if(currentState) rc = publish(node, &node->pub_topics[index], "1");
+		else rc = publish(node, &node->pub_topics[index], "0");
 	}
-	previousState[index] = currentState;
+	node->previous_state[index] = currentState;
 
 	return rc;
 }
 
 /*Subsribe to Home Assistant Switch States*/
-int8_t sub_relay_state(struct gpio_dt_spec *relay, char *payload, char *pub_topics){
-	int8_t rc;
+int8_t sub_relay_state(struct mqtt_node *node, uint8_t index, char *payload){
+	int8_t rc = 0;
 
 	if(!strcmp(payload, "1")) {
-		rc = publish(&client_ctx, pub_topics, "1");
-		digital_write(relay, 1);
+		node_set_relay(node, index, 1, RELAY_SRC_MQTT);
 		LOG_INF("Relay State: 1");
 	} else if(!strcmp(payload, "0")) {
-		rc = publish(&client_ctx, pub_topics, "0");
-		digital_write(relay, 0);
+		node_set_relay(node, index, 0, RELAY_SRC_MQTT);
 		LOG_INF("Relay State: 0");
 	}
 
 	return rc;
 }
 
-int8_t pub_sub(void)
+int8_t pub_sub(struct mqtt_node *node)
 {
 	int8_t rc, r = 0;
 
-	rc = try_to_connect(&client_ctx);
+	rc = try_to_connect(node);
 	SUCCESS_OR_EXIT(rc);
 
-	if (connected)
-		subscribe(&client_ctx, sub_topics, size_of_pub_topics);
+	if (node->connected)
+		subscribe(node);
 
-	while (connected) {
-		r = -1;
+	/* Publish the initial switch states, later changes arrive as events */
+	for(int index=0; index<LIMIT; index++)
+		pub_switch_state(node, index);
 
-		for(int index=0; index<LIMIT; index++)
-			pub_switch_state(&buttons[index], index, pub_topics[index]);
+	/* Relays switched over the LAN while we were offline */
+	node_sync(node);
 
-		rc = process_mqtt_and_sleep(&client_ctx, APP_SLEEP_MSECS);
-		SUCCESS_OR_BREAK(rc);
+	while (node->connected) {
+		r = -1;
+
+		rc = process_mqtt_and_sleep(node);
+		if (rc != 0) {
+			/* A proactive teardown says nothing about idle timeouts */
+			if (rc != -ENETDOWN) {
+				keepalive_shrink(node);
+			}
+			mqtt_abort(&node->client);
+			break;
+		}
 
 		r = 0;
 	}
 
 	return r;
-}
\ No newline at end of file
+}
@@ -0,0 +1,543 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/init.h>
+#include <zephyr/sys/dlist.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/settings/settings.h>
+
+#include "sched.h"
+#include "gpio.h"
+#include "config.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(sched, LOG_LEVEL_DBG);
+
+/*
+ * Hierarchical timer wheel: 4 levels of 64 slots, one tick per
+ * CONFIG_APP_SCHED_TICK_MS. Level L holds entries due in [64^L, 64^(L+1))
+ * ticks and is cascaded one level down when its slot comes up. Insert and
+ * cancel are O(1); the single k_timer is armed for the next occupied slot
+ * only, so an idle wheel costs no wakeups.
+ */
+#define LVL_BITS   6
+#define LVL_SIZE   BIT(LVL_BITS)
+#define LVL_MASK   (LVL_SIZE - 1)
+#define LEVELS     4
+#define MAX_DELTA  (BIT(LVL_BITS * LEVELS) - 1)
+
+#define TICK_MS    CONFIG_APP_SCHED_TICK_MS
+#define ENTRIES    CONFIG_APP_SCHED_ENTRIES
+
+/*
+ * Longest delay or period in seconds. Ticks are compared as int32_t and
+ * the wheel's now may trail the uptime by up to MAX_DELTA ticks, so a
+ * delay must stay below 2^31 - MAX_DELTA ticks: about 6.7 years at the
+ * default 100 ms tick, 246 days at 10 ms.
+ */
+#define SCHED_MAX_S ((uint32_t)((uint64_t)(INT32_MAX - 1 - MAX_DELTA) * TICK_MS / MSEC_PER_SEC))
+
+BUILD_ASSERT(DIV_ROUND_UP((uint64_t)SCHED_MAX_S * MSEC_PER_SEC, TICK_MS) + MAX_DELTA < INT32_MAX,
+             "schedule delays would overflow the wheel's tick arithmetic");
+
+/* Entries past ENTRIES are the per-channel auto-off timers. */
+#define AUTO_ID(channel) (ENTRIES + (channel))
+
+struct sched_entry {
+    sys_dnode_t node;
+    uint32_t expires;
+    uint32_t period;
+    uint8_t channel;
+    uint8_t state;
+    uint8_t level;
+    uint8_t slot;
+    bool active;
+};
+
+/* What is kept in settings as app/sched/<id> */
+struct sched_saved {
+    uint32_t delay_s;
+    uint32_t period_s;
+    uint8_t channel;
+    uint8_t state;
+} __packed;
+
+static struct sched_entry entries[ENTRIES + maxRelays];
+static sys_dlist_t wheel[LEVELS][LVL_SIZE];
+static uint64_t occupied[LEVELS];
+static uint32_t now;
+static uint32_t auto_off_s[maxRelays];
+static struct k_spinlock lock;
+
+static void sched_timer_handler(struct k_timer *timer);
+static void sched_work_handler(struct k_work *work);
+
+static K_TIMER_DEFINE(sched_timer, sched_timer_handler, NULL);
+static K_WORK_DEFINE(sched_work, sched_work_handler);
+
+static uint32_t wheel_tick(void) {
+    return k_uptime_get() / TICK_MS;
+}
+
+static void wheel_add(struct sched_entry *e) {
+    uint32_t expires = e->expires;
+    uint32_t delta;
+    int lvl = 0;
+
+    /* Overdue entries go into the next slot */
+    if ((int32_t)(expires - now) <= 0) {
+        expires = now + 1;
+    }
+
+    /* Beyond the top level: park as far out as possible, re-placed on cascade */
+    delta = expires - now;
+    if (delta > MAX_DELTA) {
+        expires = now + MAX_DELTA;
+        delta = MAX_DELTA;
+    }
+
+    while (lvl < LEVELS - 1 && delta >= BIT(LVL_BITS * (lvl + 1))) {
+        lvl++;
+    }
+
+    e->level = lvl;
+    e->slot = (expires >> (LVL_BITS * lvl)) & LVL_MASK;
+    sys_dlist_append(&wheel[lvl][e->slot], &e->node);
+    occupied[lvl] |= BIT64(e->slot);
+}
+
+static void wheel_del(struct sched_entry *e) {
+    sys_dlist_remove(&e->node);
+    if (sys_dlist_is_empty(&wheel[e->level][e->slot])) {
+        occupied[e->level] &= ~BIT64(e->slot);
+    }
+}
+
+static void wheel_cascade(int lvl, uint8_t slot) {
+    sys_dlist_t list;
+    sys_dnode_t *node;
+
+    sys_dlist_init(&list);
+    while ((node = sys_dlist_get(&wheel[lvl][slot])) != NULL) {
+        sys_dlist_append(&list, node);
+    }
+    occupied[lvl] &= ~BIT64(slot);
+
+    while ((node = sys_dlist_get(&list)) != NULL) {
+        struct sched_entry *e = CONTAINER_OF(node, struct sched_entry, node);
+
+        /* Due on this very tick: the level 0 slot is scanned right after */
+        if ((int32_t)(e->expires - now) <= 0) {
+            e->level = 0;
+            e->slot = now & LVL_MASK;
+            sys_dlist_append(&wheel[0][e->slot], &e->node);
+            occupied[0] |= BIT64(e->slot);
+            continue;
+        }
+
+        wheel_add(e);
+    }
+}
+
+/* Ticks from now until the next slot that needs work, 0 if the wheel is empty */
+static uint32_t wheel_next(void) {
+    uint32_t best = 0;
+
+    for (int lvl = 0; lvl < LEVELS; lvl++) {
+        uint8_t shift = LVL_BITS * lvl;
+        uint8_t cur = (now >> shift) & LVL_MASK;
+
+        if (occupied[lvl] == 0) {
+            continue;
+        }
+
+        /* Nearest occupied slot after the current one, the current is done */
+        for (uint32_t dist = 1; dist <= LVL_SIZE; dist++) {
+            if (occupied[lvl] & BIT64((cur + dist) & LVL_MASK)) {
+                uint32_t start = ((now >> shift) + dist) << shift;
+
+                if (best == 0 || start - now < best) {
+                    best = start - now;
+                }
+                break;
+            }
+        }
+    }
+
+    return best;
+}
+
+/* Advance to tick t; collect due entries into fired, returns how many */
+static size_t wheel_run(uint32_t t, struct sched_entry **fired, size_t max) {
+    sys_dlist_t *slot;
+    sys_dnode_t *node, *next;
+    size_t count = 0;
+    int top = 0;
+
+    now = t;
+
+    while (top < LEVELS - 1 && (t & (BIT(LVL_BITS * (top + 1)) - 1)) == 0) {
+        top++;
+    }
+    for (int lvl = top; lvl > 0; lvl--) {
+        wheel_cascade(lvl, (t >> (LVL_BITS * lvl)) & LVL_MASK);
+    }
+
+    slot = &wheel[0][t & LVL_MASK];
+    SYS_DLIST_FOR_EACH_NODE_SAFE(slot, node, next) {
+        struct sched_entry *e = CONTAINER_OF(node, struct sched_entry, node);
+
+        if ((int32_t)(e->expires - t) > 0) {
+            /* Parked beyond the wheel range, not due yet */
+            wheel_del(e);
+            wheel_add(e);
+            continue;
+        }
+
+        if (count == max) {
+            /* Leave the rest for the next pass over this tick */
+            now = t - 1;
+            break;
+        }
+
+        wheel_del(e);
+        fired[count++] = e;
+
+        if (e->period) {
+            e->expires += e->period;
+            wheel_add(e);
+        } else {
+            e->active = false;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Called with lock held, so an auto-off armed from an ISR cannot have its
+ * earlier deadline overwritten by a stale one computed just before it.
+ */
+static void wheel_rearm(void) {
+    uint32_t next = wheel_next();
+
+    if (next == 0) {
+        k_timer_stop(&sched_timer);
+    } else {
+        k_timer_start(&sched_timer, K_TIMEOUT_ABS_MS((int64_t)(now + next) * TICK_MS), K_NO_WAIT);
+    }
+}
+
+static void sched_rearm(void) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    wheel_rearm();
+    k_spin_unlock(&lock, key);
+}
+
+static void sched_timer_handler(struct k_timer *timer) {
+    k_work_submit(&sched_work);
+}
+
+#ifdef CONFIG_SETTINGS
+static int sched_forget(uint16_t id) {
+    char name[24];
+
+    if (id >= CONFIG_APP_SCHED_SAVED) {
+        return 0;
+    }
+
+    snprintk(name, sizeof(name), "app/sched/%u", id);
+    return settings_delete(name);
+}
+#endif
+
+static void sched_work_handler(struct k_work *work) {
+    struct sched_entry *fired[16];
+    struct {
+        uint16_t id;
+        uint8_t channel;
+        uint8_t state;
+        bool once;
+    } act[ARRAY_SIZE(fired)];
+    uint32_t target = wheel_tick();
+    size_t count;
+
+    do {
+        k_spinlock_key_t key = k_spin_lock(&lock);
+        uint32_t next = wheel_next();
+
+        count = 0;
+        if (next != 0 && (int32_t)(now + next - target) <= 0) {
+            count = wheel_run(now + next, fired, ARRAY_SIZE(fired));
+        }
+
+        /* Copy out before unlocking, entries may be re-armed meanwhile */
+        for (size_t i = 0; i < count; i++) {
+            act[i].id = fired[i] - entries;
+            act[i].channel = fired[i]->channel;
+            act[i].state = fired[i]->state;
+            act[i].once = !fired[i]->active;
+        }
+        k_spin_unlock(&lock, key);
+
+        /* Relay actions run unlocked, relay_set() calls back into auto-off */
+        for (size_t i = 0; i < count; i++) {
+            relay_set(act[i].channel, act[i].state, RELAY_SRC_RULE);
+            relay_notify(act[i].channel);
+#ifdef CONFIG_SETTINGS
+            if (act[i].once && act[i].id < ENTRIES && sched_forget(act[i].id) != 0) {
+                LOG_WRN("Schedule %u fired but is still saved", act[i].id);
+            }
+#endif
+        }
+    } while (count > 0);
+
+    sched_rearm();
+}
+
+static int8_t sched_arm(uint16_t id, uint8_t channel, bool state, uint32_t delay_s, uint32_t period_s) {
+    struct sched_entry *e = &entries[id];
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    if (e->active) {
+        wheel_del(e);
+    }
+
+    /* An empty wheel stops the clock; catch up so deltas stay small */
+    if (!occupied[0] && !occupied[1] && !occupied[2] && !occupied[3]) {
+        now = wheel_tick();
+    }
+
+    /* Round the deadline itself up to a tick, never fire early */
+    e->expires = DIV_ROUND_UP(k_uptime_get() + (uint64_t)delay_s * MSEC_PER_SEC, TICK_MS);
+    e->period = (uint64_t)period_s * MSEC_PER_SEC / TICK_MS;
+    e->channel = channel;
+    e->state = state;
+    e->active = true;
+    wheel_add(e);
+    wheel_rearm();
+
+    k_spin_unlock(&lock, key);
+
+    return 0;
+}
+
+int8_t sched_add(uint16_t id, uint8_t channel, bool state, uint32_t delay_s, uint32_t period_s) {
+    if (id >= ENTRIES || channel >= LIMIT || delay_s > SCHED_MAX_S || period_s > SCHED_MAX_S) {
+        return -EINVAL;
+    }
+
+#ifdef CONFIG_SETTINGS
+    /* No wall clock: after a reboot the delay counts again from boot */
+    if (id < CONFIG_APP_SCHED_SAVED) {
+        struct sched_saved saved = {
+            .delay_s = delay_s,
+            .period_s = period_s,
+            .channel = channel,
+            .state = state,
+        };
+        char name[24];
+        int ret;
+
+        snprintk(name, sizeof(name), "app/sched/%u", id);
+        ret = settings_save_one(name, &saved, sizeof(saved));
+        if (ret != 0) {
+            LOG_ERR("Error %d: schedule %u not saved", ret, id);
+            return ret;
+        }
+    }
+#endif
+
+    return sched_arm(id, channel, state, delay_s, period_s);
+}
+
+int8_t sched_del(uint16_t id) {
+    int ret = 0;
+
+    if (id >= ENTRIES) {
+        return -EINVAL;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (entries[id].active) {
+        wheel_del(&entries[id]);
+        entries[id].active = false;
+    }
+    k_spin_unlock(&lock, key);
+
+#ifdef CONFIG_SETTINGS
+    /* Cancelled now either way, but it would come back after a reboot */
+    ret = sched_forget(id);
+#endif
+
+    sched_rearm();
+
+    return ret;
+}
+
+int8_t sched_auto_off(uint8_t channel, uint32_t auto_s) {
+    if (channel >= LIMIT || auto_s > SCHED_MAX_S) {
+        return -EINVAL;
+    }
+
+    auto_off_s[channel] = auto_s;
+
+#ifdef CONFIG_SETTINGS
+    return settings_save_one("app/sched/auto", auto_off_s, sizeof(auto_off_s));
+#else
+    return 0;
+#endif
+}
+
+void sched_relay_changed(uint8_t channel, bool state) {
+    uint16_t id = AUTO_ID(channel);
+
+    if (state && auto_off_s[channel] > 0) {
+        sched_arm(id, channel, false, auto_off_s[channel], 0);
+        return;
+    }
+
+    if (!state && entries[id].active) {
+        k_spinlock_key_t key = k_spin_lock(&lock);
+        if (entries[id].active) {
+            wheel_del(&entries[id]);
+            entries[id].active = false;
+        }
+        k_spin_unlock(&lock, key);
+    }
+}
+
+/* Parse one decimal field no larger than max and advance *p past it */
+static bool sched_field(char **p, uint32_t max, uint32_t *val) {
+    char *end;
+    unsigned long v;
+
+    while (**p == ' ') {
+        (*p)++;
+    }
+    if (**p < '0' || **p > '9') {
+        return false;
+    }
+
+    v = strtoul(*p, &end, 10);
+    if ((*end != ' ' && *end != '\0') || v > max) {
+        return false;
+    }
+
+    *val = v;
+    *p = end;
+    return true;
+}
+
+/* Nothing but spaces left */
+static bool sched_end(char *p) {
+    while (*p == ' ') {
+        p++;
+    }
+    return *p == '\0';
+}
+
+int8_t sched_command(char *cmd) {
+    char *p;
+    uint32_t id, channel, state, delay_s, period_s = 0;
+    int8_t ret = -EINVAL;
+
+    if (!strncmp(cmd, "add ", 4)) {
+        p = cmd + 4;
+        if (sched_field(&p, ENTRIES - 1, &id) &&
+            sched_field(&p, LIMIT - 1, &channel) &&
+            sched_field(&p, 1, &state) &&
+            sched_field(&p, SCHED_MAX_S, &delay_s) &&
+            (sched_end(p) || sched_field(&p, SCHED_MAX_S, &period_s)) &&
+            sched_end(p)) {
+            ret = sched_add(id, channel, state, delay_s, period_s);
+        }
+    } else if (!strncmp(cmd, "del ", 4)) {
+        p = cmd + 4;
+        if (sched_field(&p, ENTRIES - 1, &id) && sched_end(p)) {
+            ret = sched_del(id);
+        }
+    } else if (!strncmp(cmd, "auto ", 5)) {
+        p = cmd + 5;
+        if (sched_field(&p, LIMIT - 1, &channel) &&
+            sched_field(&p, SCHED_MAX_S, &delay_s) && sched_end(p)) {
+            ret = sched_auto_off(channel, delay_s);
+        }
+    }
+
+    if (ret != 0) {
+        LOG_ERR("Error %d: bad schedule command \"%s\"", ret, cmd);
+    }
+
+    return ret;
+}
+
+#ifdef CONFIG_SETTINGS
+static int sched_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg) {
+    const char *next;
+
+    if (settings_name_steq(name, "auto", &next) && !next) {
+        if (len != sizeof(auto_off_s)) {
+            return -EINVAL;
+        }
+        return MIN(read_cb(cb_arg, auto_off_s, len), 0);
+    }
+
+    struct sched_saved saved;
+    uint32_t id = strtoul(name, NULL, 10);
+
+    if (id >= ENTRIES || len != sizeof(saved) || read_cb(cb_arg, &saved, len) != len) {
+        return -EINVAL;
+    }
+
+    /* Saved by an image with a longer tick or a larger cap */
+    if (saved.channel >= LIMIT || saved.delay_s > SCHED_MAX_S || saved.period_s > SCHED_MAX_S) {
+        return -EINVAL;
+    }
+
+    return sched_arm(id, saved.channel, saved.state, saved.delay_s, saved.period_s);
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(app_sched, "app/sched", NULL, sched_set, NULL, NULL);
+#endif
+
+int sched_load(void) {
+#ifdef CONFIG_SETTINGS
+    int ret = settings_subsys_init();
+    if (ret != 0) {
+        LOG_ERR("Error %d: settings unavailable, schedules not restored", ret);
+        return ret;
+    }
+
+    settings_load_subtree("app/sched");
+#endif
+
+    /* Relays switched on at boot, before the auto-off table was known */
+    for (uint8_t channel = 0; channel < LIMIT; channel++) {
+        if (relay_get(channel)) {
+            sched_relay_changed(channel, true);
+        }
+    }
+
+    return 0;
+}
+
+static int sched_init(void) {
+    for (int lvl = 0; lvl < LEVELS; lvl++) {
+        for (int slot = 0; slot < LVL_SIZE; slot++) {
+            sys_dlist_init(&wheel[lvl][slot]);
+        }
+    }
+
+    return 0;
+}
+
+/* Before settings are loaded, which may already arm entries */
+SYS_INIT(sched_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
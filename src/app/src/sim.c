@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/posix/sys/eventfd.h>
+
+#include "mqtt.h"
+#include "sim.h"
+#include "config.h"
+#include "host_clock.h"
+#ifdef CONFIG_APP_LAN_CONTROL
+#include "lan.h"
+#endif
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(sim, LOG_LEVEL_INF);
+
+#define SIM_NODES CONFIG_APP_SIM_NODES
+
+/* Event fd and broker socket per node, plus the LAN socket if enabled */
+#define SIM_FDS_PER_NODE (2 + IS_ENABLED(CONFIG_APP_LAN_CONTROL))
+/* stdio and the odd resolver socket */
+#define SIM_FDS_SPARE 8
+
+#ifdef CONFIG_POSIX_MAX_FDS
+BUILD_ASSERT(CONFIG_POSIX_MAX_FDS >= SIM_NODES * SIM_FDS_PER_NODE + SIM_FDS_SPARE,
+             "CONFIG_POSIX_MAX_FDS too small for CONFIG_APP_SIM_NODES");
+#endif
+
+static struct mqtt_node nodes[SIM_NODES];
+
+static K_THREAD_STACK_ARRAY_DEFINE(node_stacks, SIM_NODES, CONFIG_APP_SIM_STACK_SIZE);
+static struct k_thread node_threads[SIM_NODES];
+
+/*
+ * Button press to status echo latency, reset on every report. Also guards
+ * press_ns, written by the press script and cleared by node threads.
+ *
+ * Latency and rates use the host clock: simulated time stands still while
+ * code runs, so it would leave out the client's own CPU cost.
+ */
+static struct k_spinlock lock;
+static uint32_t lat_count;
+static uint64_t lat_sum_us;
+static uint32_t lat_min_us = UINT32_MAX;
+static uint32_t lat_max_us;
+
+void sim_status_echo(struct mqtt_node *node, uint8_t index) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    uint64_t pressed = node->press_ns[index];
+
+    if (pressed == 0) {
+        k_spin_unlock(&lock, key);
+        return;
+    }
+    node->press_ns[index] = 0;
+
+    uint32_t us = (host_clock_ns() - pressed) / NSEC_PER_USEC;
+
+    lat_count++;
+    lat_sum_us += us;
+    lat_min_us = MIN(lat_min_us, us);
+    lat_max_us = MAX(lat_max_us, us);
+    k_spin_unlock(&lock, key);
+}
+
+static void node_thread(void *p1, void *p2, void *p3) {
+    struct mqtt_node *node = p1;
+
+    while (1) {
+        pub_sub(node);
+        mqtt_node_idle(node, APP_RECONNECT_MSECS);
+    }
+}
+
+static void sim_report(uint64_t elapsed_ms) {
+    static uint32_t last_tx, last_rx;
+    uint32_t tx = 0, rx = 0, up = 0;
+
+    for (int i = 0; i < SIM_NODES; i++) {
+        tx += nodes[i].tx;
+        rx += nodes[i].rx;
+        up += nodes[i].connected;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    uint32_t count = lat_count;
+    uint32_t avg = count ? lat_sum_us / count : 0;
+    uint32_t min = count ? lat_min_us : 0;
+    uint32_t max = lat_max_us;
+    lat_count = 0;
+    lat_sum_us = 0;
+    lat_min_us = UINT32_MAX;
+    lat_max_us = 0;
+    k_spin_unlock(&lock, key);
+
+    LOG_INF("nodes %u/%d, tx %llu msg/s, rx %llu msg/s, latency us min/avg/max %u/%u/%u (%u samples)",
+            up, SIM_NODES,
+            (tx - last_tx) * 1000ULL / elapsed_ms, (rx - last_rx) * 1000ULL / elapsed_ms,
+            min, avg, max, count);
+
+    last_tx = tx;
+    last_rx = rx;
+}
+
+void sim_run(void) {
+    char client_id[APP_CLIENTID_LEN];
+    char prefix[16];
+
+    for (int i = 0; i < SIM_NODES; i++) {
+        int fd = eventfd(0, EFD_NONBLOCK);
+
+        if (fd < 0) {
+            LOG_ERR("Error: out of fds after %d nodes", i);
+            return;
+        }
+
+        /* Unique id and topic tree per node, as a real fleet would have */
+        snprintk(client_id, sizeof(client_id), MQTT_CLIENTID "-sim%d", i);
+        snprintk(prefix, sizeof(prefix), "/sim%d", i);
+        mqtt_node_init(&nodes[i], client_id, prefix, fd);
+#ifdef CONFIG_APP_LAN_CONTROL
+        nodes[i].lan_fd = lan_open(CONFIG_APP_LAN_PORT + i);
+#endif
+
+        k_thread_create(&node_threads[i], node_stacks[i], K_THREAD_STACK_SIZEOF(node_stacks[i]),
+                        node_thread, &nodes[i], NULL, NULL, K_PRIO_PREEMPT(7), 0, K_NO_WAIT);
+    }
+
+    LOG_INF("Simulating %d nodes, one press per node every %d ms", SIM_NODES, CONFIG_APP_SIM_PRESS_MS);
+
+    /* Round-robin over nodes and buttons so the load is spread evenly */
+    int64_t report_at = k_uptime_get() + CONFIG_APP_SIM_REPORT_SEC * MSEC_PER_SEC;
+    uint64_t report_from = host_clock_ns();
+    uint32_t step = 0;
+
+    while (1) {
+        k_msleep(MAX(CONFIG_APP_SIM_PRESS_MS / SIM_NODES, 1));
+
+        struct mqtt_node *node = &nodes[step % SIM_NODES];
+        uint8_t index = (step / SIM_NODES) % LIMIT;
+        step++;
+
+        if (node->connected) {
+            /* What the button ISR does: flip the input, relay follows */
+            node->sim_buttons[index] = !node->sim_buttons[index];
+            node->sim_relays[index] = node->sim_buttons[index];
+            k_spinlock_key_t key = k_spin_lock(&lock);
+            node->press_ns[index] = host_clock_ns();
+            k_spin_unlock(&lock, key);
+            eventfd_write(node->event_fd, 1);
+        }
+
+        if (k_uptime_get() >= report_at) {
+            sim_report(MAX((host_clock_ns() - report_from) / NSEC_PER_MSEC, 1));
+            report_from = host_clock_ns();
+            report_at = k_uptime_get() + CONFIG_APP_SIM_REPORT_SEC * MSEC_PER_SEC;
+        }
+    }
+}
@@ -17,6 +17,9 @@
 
 #include "wifi.h"
 #include "config.h"
+#ifdef CONFIG_APP_LINK_MONITOR
+#include "linkmon.h"
+#endif
 
 LOG_MODULE_REGISTER(wifi_app, LOG_LEVEL_DBG);
 
@@ -26,6 +29,18 @@ static K_SEM_DEFINE(ipv4_address_obtained, 0, 1);
 static struct net_mgmt_event_callback wifi_cb;
 static struct net_mgmt_event_callback ipv4_cb;
 
+/* Kept for reconnecting after a roam */
+static char *wifi_ssid;
+static char *wifi_psk;
+static bool roam_pending;
+
+static void wifi_reconnect_handler(struct k_work *work)
+{
+    wifi_connect(wifi_ssid, wifi_psk);
+}
+
+static K_WORK_DEFINE(wifi_reconnect_work, wifi_reconnect_handler);
+
 static void handle_ipv4_result(struct net_if *iface)
 {
     int i = 0;
@@ -82,6 +97,15 @@ static int handle_wifi_disconnect_result(struct net_mgmt_event_callback *cb)
     {
         LOG_INF("Disconnected");
         k_sem_take(&wifi_connected, K_NO_WAIT);
+
+#ifdef CONFIG_APP_LINK_MONITOR
+        link_lost();
+#endif
+        /* Our own disconnect is not retried by the driver */
+        if (roam_pending) {
+            roam_pending = false;
+            k_work_submit(&wifi_reconnect_work);
+        }
     }
 	return status->status;
 }
@@ -135,13 +159,18 @@ void wifi_connect(char *SSID, char *PSK)
     }
 }
 
-int8_t wifi_status(void)
+int wifi_sample(struct wifi_iface_status *status)
 {
     struct net_if *iface = net_if_get_default();
 
+    return net_mgmt(NET_REQUEST_WIFI_IFACE_STATUS, iface, status, sizeof(struct wifi_iface_status));
+}
+
+int8_t wifi_status(void)
+{
     struct wifi_iface_status status = {0};
 
-    if (net_mgmt(NET_REQUEST_WIFI_IFACE_STATUS, iface, &status,	sizeof(struct wifi_iface_status)))
+    if (wifi_sample(&status))
     {
         LOG_INF("WiFi Status Request Failed");
         return 0;
@@ -168,6 +197,17 @@ void wifi_disconnect(void)
     }
 }
 
+void wifi_roam(void)
+{
+    if (wifi_ssid == NULL) {
+        return;
+    }
+
+    /* Reassociate, picking the strongest AP for the SSID */
+    roam_pending = true;
+    wifi_disconnect();
+}
+
 void wifi_ap(void){
 
     struct wifi_connect_req_params ap_params = {
@@ -220,6 +260,9 @@ int8_t wifi_init(char *SSID, char *PSK)
 {
     LOG_INF("WiFi Initialized: %s", CONFIG_BOARD);
 
+    wifi_ssid = SSID;
+    wifi_psk = PSK;
+
     net_mgmt_init_event_callback(&wifi_cb, wifi_mgmt_event_handler,
                                  NET_EVENT_WIFI_CONNECT_RESULT | NET_EVENT_WIFI_DISCONNECT_RESULT);
 
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/sys/util.h>
+
+#include "zerocross.h"
+#include "gpio.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(zerocross, LOG_LEVEL_DBG);
+
+/*
+ * One edge per zero crossing, i.e. per half-cycle: 10 ms at 50 Hz and
+ * 8.33 ms at 60 Hz. Intervals outside this window are noise or missed
+ * edges and do not update the estimate.
+ */
+#define HALF_CYCLE_MIN_US 7000
+#define HALF_CYCLE_MAX_US 12000
+
+/* Valid intervals in a row before queued switching is used */
+#define LOCK_EDGES 4
+
+/* Edges lost for this long drop the lock and flush the queue */
+#define LOST_US (3 * HALF_CYCLE_MAX_US)
+
+static const struct gpio_dt_spec zc_input = GPIO_DT_SPEC_GET(DT_ALIAS(zc0), gpios);
+static struct gpio_callback zc_cb;
+
+static struct k_spinlock lock;
+
+/* Phase lock: last edge and smoothed half-cycle, in hardware cycles */
+static uint32_t last_edge;
+static uint32_t half_cycle;
+static uint8_t locked;
+
+/* Pending writes, one slot per relay so repeated commands coalesce */
+static uint32_t pending;
+static uint32_t pending_state;
+static uint32_t queued_at[maxRelays];
+
+/* Expected crossing of the last release, to measure timing error */
+static uint32_t release_target;
+static bool release_check;
+static struct zc_stats stats;
+
+static void zc_release_handler(struct k_timer *timer);
+static void zc_lost_handler(struct k_timer *timer);
+
+static K_TIMER_DEFINE(zc_release_timer, zc_release_handler, NULL);
+static K_TIMER_DEFINE(zc_lost_timer, zc_lost_handler, NULL);
+
+/* Drive up to max queued relays, lowest index first. Called with lock held. */
+static void zc_release(uint32_t max) {
+    uint32_t now = k_cycle_get_32();
+
+    while (pending && max--) {
+        uint8_t index = find_lsb_set(pending) - 1;
+
+        uint32_t delay_us = k_cyc_to_us_floor32(now - queued_at[index]);
+
+        pending &= ~BIT(index);
+        digital_write(&relays[index], !!(pending_state & BIT(index)));
+
+        stats.releases++;
+        stats.delay_us = delay_us;
+        stats.delay_max_us = MAX(stats.delay_max_us, delay_us);
+        LOG_DBG("Relay %u switched, queued %u us", index, delay_us);
+    }
+
+    /* Nothing left to flush if edges stop */
+    if (!pending) {
+        k_timer_stop(&zc_lost_timer);
+    }
+}
+
+static void zc_release_handler(struct k_timer *timer) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    /* Contacts close LEAD_US after the coil is driven, aim that at the crossing */
+    release_target = k_cycle_get_32() + k_us_to_cyc_ceil32(CONFIG_APP_ZERO_CROSS_LEAD_US);
+    release_check = true;
+    zc_release(CONFIG_APP_ZERO_CROSS_GROUP);
+
+    k_spin_unlock(&lock, key);
+}
+
+static void zc_lost_handler(struct k_timer *timer) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    /* Raced with an edge that re-armed us, the mains is still there */
+    if (k_cyc_to_us_floor32(k_cycle_get_32() - last_edge) < LOST_US) {
+        k_spin_unlock(&lock, key);
+        return;
+    }
+
+    if (locked) {
+        LOG_WRN("Zero-cross edges lost, switching relays immediately");
+    }
+    locked = 0;
+    zc_release(UINT32_MAX);
+
+    k_spin_unlock(&lock, key);
+}
+
+static void zc_edge(const struct device *dev, struct gpio_callback *cb, uint32_t pins) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    uint32_t now = k_cycle_get_32();
+    uint32_t dt = now - last_edge;
+    uint32_t dt_us = k_cyc_to_us_floor32(dt);
+
+    if (dt_us < HALF_CYCLE_MIN_US) {
+        /* Bounce or a noisy detector, keep the first edge */
+        k_spin_unlock(&lock, key);
+        return;
+    }
+
+    last_edge = now;
+
+    if (dt_us > HALF_CYCLE_MAX_US) {
+        /* Missed edges, start locking again */
+        locked = 0;
+    } else if (locked == 0 || half_cycle == 0) {
+        half_cycle = dt;
+        locked = 1;
+    } else {
+        /* 1/8 IIR, follows grid drift without jumping on one late edge */
+        half_cycle += ((int32_t)(dt - half_cycle)) / 8;
+        if (locked < LOCK_EDGES) {
+            locked++;
+        }
+    }
+
+    if (release_check) {
+        int32_t err = now - release_target;
+        uint32_t err_abs = k_cyc_to_us_floor32(err >= 0 ? err : -err);
+
+        /* Positive when the crossing came after the contacts closed */
+        stats.error_us = err >= 0 ? (int32_t)err_abs : -(int32_t)err_abs;
+        stats.error_max_us = MAX(stats.error_max_us, err_abs);
+        LOG_DBG("Actuation timing error %d us", stats.error_us);
+        release_check = false;
+    }
+
+    if (pending && locked >= LOCK_EDGES) {
+        uint32_t lead = k_us_to_cyc_ceil32(CONFIG_APP_ZERO_CROSS_LEAD_US);
+        uint32_t wait = half_cycle > lead ? half_cycle - lead : 0;
+
+        /* Fire so the contacts close on the next predicted crossing */
+        k_timer_start(&zc_release_timer, K_CYC(wait), K_NO_WAIT);
+    }
+
+    if (pending) {
+        k_timer_start(&zc_lost_timer, K_USEC(LOST_US), K_NO_WAIT);
+    }
+
+    k_spin_unlock(&lock, key);
+}
+
+bool zc_queue(uint8_t index, bool state) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    bool queued = locked >= LOCK_EDGES &&
+                  k_cyc_to_us_floor32(k_cycle_get_32() - last_edge) < LOST_US;
+
+    if (queued) {
+        if (!(pending & BIT(index))) {
+            queued_at[index] = k_cycle_get_32();
+        }
+        pending |= BIT(index);
+        WRITE_BIT(pending_state, index, state);
+        k_timer_start(&zc_lost_timer, K_USEC(LOST_US), K_NO_WAIT);
+    }
+
+    k_spin_unlock(&lock, key);
+
+    return queued;
+}
+
+void zc_stats_get(struct zc_stats *out) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    *out = stats;
+    out->locked = locked >= LOCK_EDGES;
+    out->half_cycle_us = k_cyc_to_us_floor32(half_cycle);
+
+    k_spin_unlock(&lock, key);
+}
+
+int zc_init(void) {
+    int ret;
+
+    if (!gpio_is_ready_dt(&zc_input)) {
+        LOG_ERR("Error: zero-cross GPIO device %s is not ready", zc_input.port->name);
+        return -ENODEV;
+    }
+
+    ret = gpio_pin_configure_dt(&zc_input, GPIO_INPUT);
+    if (ret != 0) {
+        LOG_ERR("Error %d: failed to configure zero-cross pin %d", ret, zc_input.pin);
+        return ret;
+    }
+
+    gpio_init_callback(&zc_cb, zc_edge, BIT(zc_input.pin));
+    gpio_add_callback(zc_input.port, &zc_cb);
+
+    ret = gpio_pin_interrupt_configure_dt(&zc_input, GPIO_INT_EDGE_TO_ACTIVE);
+    if (ret != 0) {
+        LOG_ERR("Error %d: failed to configure zero-cross interrupt", ret);
+        return ret;
+    }
+
+    LOG_INF("Zero-cross switching on pin %d, %u relay(s) per half-cycle",
+            zc_input.pin, CONFIG_APP_ZERO_CROSS_GROUP);
+
+    return 0;
+}
@@ -18,12 +18,39 @@
 #include "mqtt.h"
 #include "gpio.h"
 #include "config.h"
+#include "identity.h"
+#ifdef CONFIG_APP_ENERGY_METER
+#include "energy.h"
+#endif
+#ifdef CONFIG_APP_EVENT_LOG
+#include "eventlog.h"
+#endif
+#ifdef CONFIG_APP_LAN_CONTROL
+#include "lan.h"
+#endif
+#ifdef CONFIG_APP_ZERO_CROSS
+#include "zerocross.h"
+#endif
+#ifdef CONFIG_APP_LINK_MONITOR
+#include "linkmon.h"
+#endif
+#ifdef CONFIG_APP_SCHED
+#include "sched.h"
+#endif
+#ifdef CONFIG_APP_SIM
+#include "sim.h"
+#else
+/* The local node: this board's buttons, relays and topics */
+static struct mqtt_node node;
+static char client_id[APP_CLIENTID_LEN];
+static char topic_prefix[APP_PREFIX_LEN];
+#endif
 
 /**
  * @brief The main loop.
  *
- * This function initializes Wi-Fi and then enters an infinite loop,
- * calling the pubSub() function every 100 milliseconds.
+ * This function initializes Wi-Fi and then enters an infinite loop
+ * around pub_sub(), which only returns when the broker connection is lost.
  *
  * @return void
  */
@@ -31,6 +58,15 @@ int main(void)
 {
     int rc = 0;
 
+#ifdef CONFIG_APP_SIM
+    /* Virtual fleet against the broker, no local GPIO or Wi-Fi */
+    sim_run();
+#else
+#ifdef CONFIG_APP_EVENT_LOG
+    /* Find the end of the relay history before the first relay change */
+    event_log_init();
+#endif
+
     /* Initialize the GPIO pins for the buttons and relays */
 
     // Loop over the number of buttons and relays
@@ -43,22 +79,58 @@ int main(void)
         // Read the state of the button
         bool state = digital_read(&buttons[index]);
         // Set the state of the corresponding relay
-        digital_write(&relays[index], state);
+        relay_set(index, state, RELAY_SRC_BOOT);
+    }
+
+#ifdef CONFIG_APP_EVENT_LOG
+    /* The next boot number comes from flash, so the boot records must be there */
+    event_log_flush();
+#endif
+
+#ifdef CONFIG_APP_SCHED
+    /* Schedules must run even if Wi-Fi never comes up */
+    sched_load();
+#endif
+
+#ifdef CONFIG_APP_ZERO_CROSS
+    /* Later relay writes wait for a mains zero crossing */
+    zc_init();
+#endif
+
+#ifdef CONFIG_APP_ENERGY_METER
+    /* Start sampling the per-relay current-sense inputs */
+    rc = energy_init();
+    if (rc != 0) {
+        printk("Energy metering unavailable (%d), no energy reports\n", rc);
     }
+#endif
 
     /* Initialize Wi-Fi with the SSID and password */
     rc = wifi_init("Ammad_C-25", "ammad175");
 
+    /* Per-device client id and topic prefix, so one image serves the fleet */
+    node_identity(client_id, sizeof(client_id), topic_prefix, sizeof(topic_prefix));
+    mqtt_node_init(&node, client_id, topic_prefix, gpio_event_fd());
+#ifdef CONFIG_APP_LAN_CONTROL
+    node.lan_fd = lan_open(CONFIG_APP_LAN_PORT);
+#endif
+#ifdef CONFIG_APP_LINK_MONITOR
+    /* Watch RSSI and drop the broker connection before it times out */
+    node.link_fd = link_monitor_init();
+#endif
+
     while (1) {
         /*
-         * Publish and subscribe to MQTT topics every 100 milliseconds.
-         * This function will handle connecting to the MQTT broker,
-         * subscribing to topics, and publishing messages.
+         * Connect to the MQTT broker, subscribe to topics and then sleep
+         * until broker data, a button edge or the next keepalive is due.
          */
-        pub_sub();
+        pub_sub(&node);
 
-        // Sleep for 100 milliseconds before the next iteration
-        k_msleep(100);
+        // Back off before reconnecting, LAN commands are still served
+        mqtt_node_idle(&node, APP_RECONNECT_MSECS);
     }
+#endif
+
+    return rc;
 }
 
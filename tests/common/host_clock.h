@@ -0,0 +1,15 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef HOST_CLOCK_H
+#define HOST_CLOCK_H
+
+#include <stdint.h>
+
+/* Host CLOCK_MONOTONIC in ns, for timing code on native_sim */
+uint64_t host_clock_ns(void);
+
+#endif
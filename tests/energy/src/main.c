@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Accuracy of the energy kernel on synthetic waveforms and its throughput
+ * in samples per second on one host core, for the unit stride and for the
+ * two-channel interleave energy.c uses on device.
+ */
+
+#include <math.h>
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "energy.h"
+#include "host_clock.h"
+
+/* Whole periods of 50 Hz at 2 kHz sampling (APP_ENERGY_SAMPLE_US 500) */
+#define PERIOD   40
+#define SAMPLES  (PERIOD * 25)
+#define BIAS     2048
+#define AMPL     1000
+
+#define BENCH_ROUNDS 20000
+
+static int16_t wave[SAMPLES * 2];
+
+static void fill(int16_t (*shape)(int i), size_t stride) {
+    for (int i = 0; i < SAMPLES; i++) {
+        for (size_t ch = 0; ch < stride; ch++) {
+            wave[i * stride + ch] = BIAS + shape(i);
+        }
+    }
+}
+
+static int16_t sine(int i) {
+    return (int16_t)lround(AMPL * sin(2 * M_PI * i / PERIOD));
+}
+
+static int16_t square(int i) {
+    return i % PERIOD < PERIOD / 2 ? AMPL : -AMPL;
+}
+
+/* Zero-mean triangle between -AMPL and AMPL */
+static int16_t triangle(int i) {
+    int p = i % PERIOD;
+    int up = p < PERIOD / 2 ? p : PERIOD - p;
+
+    return (int16_t)(AMPL * (4 * up - PERIOD) / PERIOD);
+}
+
+static void check(int16_t (*shape)(int i), uint32_t rms, uint32_t peak) {
+    struct energy_acc acc;
+
+    fill(shape, 1);
+    energy_acc_reset(&acc);
+    energy_accumulate(&acc, wave, SAMPLES, 1);
+
+    zassert_within(energy_acc_rms(&acc), rms, 2, "rms %u", energy_acc_rms(&acc));
+    zassert_within(energy_acc_peak(&acc), peak, 2, "peak %u", energy_acc_peak(&acc));
+}
+
+ZTEST(energy, test_waveforms) {
+    /* AMPL/sqrt(2), AMPL, AMPL/sqrt(3) */
+    check(sine, 707, AMPL);
+    check(square, AMPL, AMPL);
+    check(triangle, 577, AMPL);
+}
+
+/*
+ * A bias between two counts with a small or no signal: a truncated mean
+ * used to read this as about 45 counts of current.
+ */
+ZTEST(energy, test_half_count_bias) {
+    struct energy_acc acc;
+
+    /* Flat at 2048.5, the ADC toggling between the two nearest codes */
+    for (int i = 0; i < SAMPLES; i++) {
+        wave[i] = BIAS + (i & 1);
+    }
+    energy_acc_reset(&acc);
+    energy_accumulate(&acc, wave, SAMPLES, 1);
+    zassert_true(energy_acc_rms(&acc) <= 1, "flat rms %u", energy_acc_rms(&acc));
+
+    /* 7-count sine on the same bias, 7/sqrt(2) */
+    for (int i = 0; i < SAMPLES; i++) {
+        wave[i] = (int16_t)lround(BIAS + 0.5 + 7 * sin(2 * M_PI * i / PERIOD));
+    }
+    energy_acc_reset(&acc);
+    energy_accumulate(&acc, wave, SAMPLES, 1);
+    zassert_within(energy_acc_rms(&acc), 5, 1, "sine rms %u", energy_acc_rms(&acc));
+}
+
+ZTEST(energy, test_interleaved_matches_contiguous) {
+    struct energy_acc a, b;
+
+    fill(sine, 1);
+    energy_acc_reset(&a);
+    energy_accumulate(&a, wave, SAMPLES, 1);
+
+    fill(sine, 2);
+    energy_acc_reset(&b);
+    energy_accumulate(&b, &wave[1], SAMPLES, 2);
+
+    zassert_equal(energy_acc_rms(&a), energy_acc_rms(&b));
+    zassert_equal(energy_acc_peak(&a), energy_acc_peak(&b));
+}
+
+static void bench(size_t stride) {
+    struct energy_acc acc;
+    uint64_t t0, ns;
+
+    fill(sine, stride);
+    energy_acc_reset(&acc);
+
+    t0 = host_clock_ns();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        energy_accumulate(&acc, wave, SAMPLES, stride);
+    }
+    ns = host_clock_ns() - t0;
+
+    zassert_within(energy_acc_rms(&acc), 707, 2);
+
+    TC_PRINT("stride %u: %llu Msamples/s per core\n", (unsigned int)stride,
+             (unsigned long long)((uint64_t)BENCH_ROUNDS * SAMPLES * 1000 / MAX(ns, 1)));
+}
+
+ZTEST(energy, test_throughput) {
+    bench(1);
+    /* energy.c reduces two interleaved channels in place */
+    bench(2);
+}
+
+ZTEST_SUITE(energy, NULL, NULL, NULL, NULL, NULL);
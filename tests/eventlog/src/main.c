@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Event log ring on the simulated flash: wrapping, recovery after a
+ * reboot and reads from a start sequence. Also prints write and upload
+ * read throughput with the host clock; these cover the ring code and
+ * the flash simulator only, not SPI flash timing or the MQTT publish.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/storage/flash_map.h>
+
+#include "eventlog.h"
+#include "host_clock.h"
+
+#define BATCH CONFIG_APP_EVENT_LOG_BATCH
+#define CHUNK CONFIG_APP_EVENT_LOG_CHUNK
+
+#define RING_RECS (FIXED_PARTITION_SIZE(eventlog_partition) / sizeof(struct event_record))
+
+static uint32_t sector_recs;
+static struct event_record recs[RING_RECS];
+
+/* Log count events, writing each full batch out as the flush work would */
+static void log_events(uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        event_log(i % 2, 0, i & 1);
+        if ((i + 1) % BATCH == 0) {
+            event_log_flush();
+        }
+    }
+    event_log_flush();
+}
+
+/* Upload everything from from_seq on into recs[], returns the count */
+static size_t read_all(uint32_t from_seq) {
+    struct event_log_cursor cursor;
+    size_t n = 0;
+    int got;
+
+    zassert_ok(event_log_open(&cursor, from_seq));
+    while ((got = event_log_read(&cursor, &recs[n], MIN(CHUNK, RING_RECS - n))) > 0) {
+        n += got;
+    }
+
+    return n;
+}
+
+/* recs[] holds exactly first..last, in order */
+static void check_run(size_t n, uint32_t first, uint32_t last) {
+    zassert_equal(n, last - first + 1, "read %zu, want %u..%u", n, first, last);
+    for (size_t i = 0; i < n; i++) {
+        zassert_equal(recs[i].seq, first + i, "record %zu has seq %u", i, recs[i].seq);
+    }
+}
+
+/* Start every case from a blank partition */
+static void eventlog_before(void *fixture) {
+    const struct flash_area *fa;
+    struct flash_pages_info info;
+
+    zassert_ok(flash_area_open(FIXED_PARTITION_ID(eventlog_partition), &fa));
+    zassert_ok(flash_get_page_info_by_offs(flash_area_get_device(fa), fa->fa_off, &info));
+    zassert_ok(flash_area_erase(fa, 0, fa->fa_size));
+    flash_area_close(fa);
+
+    sector_recs = info.size / sizeof(struct event_record);
+    zassert_ok(event_log_init());
+}
+
+ZTEST(eventlog, test_wrap_keeps_newest) {
+    /* Around once, then into the second sector again */
+    uint32_t total = RING_RECS + sector_recs + sector_recs / 4;
+
+    log_events(total);
+
+    /* Sector 0 was rewritten, sector 1 is being written, 2 holds the oldest */
+    check_run(read_all(0), 2 * sector_recs, total - 1);
+}
+
+ZTEST(eventlog, test_recover_partial_sector) {
+    uint32_t total = sector_recs + sector_recs / 2;
+    uint16_t boot = event_log_boot();
+
+    log_events(total);
+
+    /* Reboot: rescan the ring and carry on after the last record */
+    zassert_ok(event_log_init());
+    zassert_equal(event_log_boot(), boot + 1);
+    log_events(10);
+
+    check_run(read_all(0), 0, total + 9);
+    zassert_equal(recs[total - 1].boot, boot);
+    zassert_equal(recs[total].boot, boot + 1);
+}
+
+ZTEST(eventlog, test_recover_sector_boundary) {
+    uint32_t total = 3 * sector_recs;
+
+    log_events(total);
+    zassert_ok(event_log_init());
+    log_events(1);
+
+    check_run(read_all(0), 0, total);
+}
+
+ZTEST(eventlog, test_recover_after_wrap) {
+    /* The newest sector is now at offset 0, below older ones */
+    uint32_t total = RING_RECS + sector_recs / 2;
+
+    log_events(total);
+    zassert_ok(event_log_init());
+    log_events(1);
+
+    check_run(read_all(0), sector_recs, total);
+}
+
+ZTEST(eventlog, test_open_from_seq) {
+    uint32_t total = 1000;
+    uint32_t oldest;
+
+    log_events(total);
+
+    check_run(read_all(700), 700, total - 1);
+    zassert_equal(read_all(total), 0);
+
+    /* Wrap, so part of what follows 500 is gone: start at the oldest kept */
+    log_events(RING_RECS);
+    total += RING_RECS;
+    zassert_not_equal(total % sector_recs, 0, "expects the last sector partly written");
+    oldest = ROUND_DOWN(total, sector_recs) - (RING_RECS - sector_recs);
+
+    check_run(read_all(500), oldest, total - 1);
+    check_run(read_all(total - 5), total - 5, total - 1);
+}
+
+ZTEST(eventlog, test_throughput) {
+    uint32_t count = 4 * RING_RECS;
+    uint64_t t0, write_ns, read_ns;
+    size_t n;
+
+    t0 = host_clock_ns();
+    log_events(count);
+    write_ns = host_clock_ns() - t0;
+
+    t0 = host_clock_ns();
+    n = read_all(0);
+    read_ns = host_clock_ns() - t0;
+
+    /* Stopped on a sector boundary, so the whole ring is readable */
+    check_run(n, count - RING_RECS, count - 1);
+
+    TC_PRINT("write: %u events in batches of %d, %llu events/s\n", count, BATCH,
+             (unsigned long long)((uint64_t)count * NSEC_PER_SEC / MAX(write_ns, 1)));
+    TC_PRINT("upload read: %u records in chunks of %d, %llu records/s, %llu KiB/s\n",
+             (unsigned int)n, CHUNK,
+             (unsigned long long)((uint64_t)n * NSEC_PER_SEC / MAX(read_ns, 1)),
+             (unsigned long long)((uint64_t)n * sizeof(struct event_record) * NSEC_PER_SEC /
+                                  1024 / MAX(read_ns, 1)));
+}
+
+ZTEST_SUITE(eventlog, NULL, NULL, eventlog_before, NULL, NULL);
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Drive the link monitor with a scripted link: a fading signal that is
+ * fixed by roaming, a hard disconnect, and a single weak AP that must not
+ * cause a reconnect loop. Reports detection lag and detection-to-recovery
+ * time as published on <prefix>/metrics/link.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+#include <zephyr/net/wifi_mgmt.h>
+#include <zephyr/posix/sys/eventfd.h>
+
+#include "wifi.h"
+#include "linkmon.h"
+
+#define SAMPLE_MS    CONFIG_APP_LINK_SAMPLE_MS
+/* Simulated time to reassociate after a roam, and to redo CONNACK */
+#define ASSOC_MS     300
+#define CONNECT_MS   50
+
+/* The scripted link, read by the monitor through wifi_sample() */
+static volatile int8_t link_rssi = -55;
+static volatile enum wifi_iface_state link_state = WIFI_STATE_COMPLETED;
+/* RSSI after a roam: a better AP, or the same weak one */
+static volatile int8_t roam_rssi = -55;
+static volatile uint32_t roams;
+
+static int link_fd;
+
+/* Counters at the start of the running case, so each case stands alone */
+static uint32_t roams_before;
+static struct link_stats before;
+
+int wifi_sample(struct wifi_iface_status *status) {
+    status->state = link_state;
+    status->rssi = link_rssi;
+    status->channel = 6;
+    return 0;
+}
+
+static void assoc_handler(struct k_work *work) {
+    link_rssi = roam_rssi;
+    link_state = WIFI_STATE_COMPLETED;
+}
+
+static K_WORK_DELAYABLE_DEFINE(assoc_work, assoc_handler);
+
+/* What wifi.c does: disconnect, report it, reassociate */
+void wifi_roam(void) {
+    roams++;
+    link_state = WIFI_STATE_DISCONNECTED;
+    link_lost();
+    k_work_reschedule(&assoc_work, K_MSEC(ASSOC_MS));
+}
+
+/* The MQTT loop's part: wait for a teardown request */
+static bool wait_teardown(int timeout_ms) {
+    eventfd_t events;
+
+    for (int t = 0; t < timeout_ms; t += 10) {
+        if (link_take_teardown()) {
+            zassert_ok(eventfd_read(link_fd, &events), "teardown without fd wakeup");
+            return true;
+        }
+        k_msleep(10);
+    }
+    return false;
+}
+
+/* The MQTT loop's part: reconnect once the station is back */
+static void reconnect(void) {
+    while (link_state != WIFI_STATE_COMPLETED) {
+        k_msleep(10);
+    }
+    k_msleep(CONNECT_MS);
+    link_mqtt_up();
+}
+
+static void *link_setup(void) {
+    link_fd = link_monitor_init();
+    zassert_true(link_fd >= 0);
+    return NULL;
+}
+
+/*
+ * Back to a good, connected link: the average recovers, which also clears
+ * the weak state, and any outage left open by an earlier case is closed.
+ */
+static void link_before(void *fixture) {
+    struct k_work_sync sync;
+    eventfd_t events;
+
+    k_work_cancel_delayable_sync(&assoc_work, &sync);
+    roam_rssi = -55;
+    link_rssi = -55;
+    link_state = WIFI_STATE_COMPLETED;
+    k_msleep(2 * CONFIG_APP_LINK_AVG_SAMPLES * SAMPLE_MS);
+
+    link_mqtt_up();
+    link_take_teardown();
+    eventfd_read(link_fd, &events);
+
+    roams_before = roams;
+    link_stats_take(&before);
+}
+
+ZTEST(linkmon, test_fading_signal_roams) {
+    struct link_stats stats;
+    int64_t crossed = 0, detected = 0;
+
+    /* Fade 3 dB per sample until the average gives way */
+    for (int8_t rssi = -55; rssi > -95 && !detected; rssi -= 3) {
+        link_rssi = rssi;
+        if (!crossed && rssi < CONFIG_APP_LINK_RSSI_LOW) {
+            crossed = k_uptime_get();
+        }
+        if (wait_teardown(SAMPLE_MS)) {
+            detected = k_uptime_get();
+        }
+    }
+
+    zassert_true(detected, "fade not detected");
+    zassert_equal(roams - roams_before, 1);
+
+    reconnect();
+    link_stats_take(&stats);
+
+    TC_PRINT("fade: detected %lld ms after the RSSI crossed %d dBm, recovered in %u ms\n",
+             (long long)(detected - crossed), CONFIG_APP_LINK_RSSI_LOW, stats.recovery_ms);
+
+    zassert_equal(stats.detections - before.detections, 1);
+    /* The moving average lags the raw value by about half its window */
+    zassert_true(detected - crossed <= CONFIG_APP_LINK_AVG_SAMPLES * SAMPLE_MS);
+    zassert_within(stats.recovery_ms, ASSOC_MS + CONNECT_MS, 2 * SAMPLE_MS);
+}
+
+ZTEST(linkmon, test_disconnect) {
+    struct link_stats stats;
+
+    /* What the Wi-Fi disconnect event does */
+    link_state = WIFI_STATE_DISCONNECTED;
+    link_lost();
+    zassert_true(wait_teardown(SAMPLE_MS), "disconnect not reported");
+
+    k_msleep(2000);
+    link_state = WIFI_STATE_COMPLETED;
+    reconnect();
+    link_stats_take(&stats);
+
+    TC_PRINT("disconnect: recovered in %u ms, worst %u ms\n",
+             stats.recovery_ms, stats.recovery_max_ms);
+
+    zassert_equal(stats.detections - before.detections, 1);
+    zassert_equal(roams - roams_before, 0);
+    zassert_within(stats.recovery_ms, 2000 + CONNECT_MS, 2 * SAMPLE_MS);
+}
+
+ZTEST(linkmon, test_weak_ap_does_not_flap) {
+    struct link_stats stats;
+
+    /* The only AP around stays weak after the roam */
+    roam_rssi = -80;
+    link_rssi = -80;
+
+    zassert_true(wait_teardown(2 * CONFIG_APP_LINK_AVG_SAMPLES * SAMPLE_MS));
+    reconnect();
+
+    /* Still weak, but no new teardown until it recovers first */
+    zassert_false(wait_teardown(3000), "reconnect loop on a weak AP");
+
+    link_stats_take(&stats);
+    TC_PRINT("weak AP: %u detections, %u roams, RSSI avg %d dBm\n",
+             stats.detections - before.detections, roams - roams_before, stats.rssi_avg);
+    zassert_equal(stats.detections - before.detections, 1);
+    zassert_equal(roams - roams_before, 1);
+}
+
+ZTEST_SUITE(linkmon, NULL, link_setup, link_before, NULL, NULL);
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Insert, cancel and fire cost of the timer wheel at 10, 1k and 10k
+ * entries, and firing jitter. Costs use the host clock since simulated
+ * time does not move while code runs; jitter uses simulated time.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "gpio.h"
+#include "sched.h"
+#include "host_clock.h"
+
+/* Spread of whole-second delays, so several entries share each slot */
+#define SPREAD_S 60
+
+static uint32_t fired;
+static int64_t armed_at;
+static int64_t jitter_max_ms;
+
+/* Stand-ins for gpio.c, which the test does not build */
+void relay_set(uint8_t index, bool state, enum relay_source source) {
+    /* Every delay is a whole number of seconds from armed_at */
+    int64_t late = (k_uptime_get() - armed_at) % MSEC_PER_SEC;
+
+    jitter_max_ms = MAX(jitter_max_ms, late);
+    fired++;
+}
+
+void relay_notify(uint8_t index) {
+}
+
+bool relay_get(uint8_t index) {
+    return false;
+}
+
+static uint32_t seed = 1;
+
+static uint32_t next_delay(void) {
+    seed = seed * 1103515245 + 12345;
+    return 1 + (seed >> 16) % SPREAD_S;
+}
+
+static void arm(uint16_t count) {
+    for (uint16_t id = 0; id < count; id++) {
+        zassert_ok(sched_add(id, id % LIMIT, true, next_delay(), 0));
+    }
+}
+
+static void bench(uint16_t count) {
+    uint64_t t0, insert_ns, cancel_ns, fire_ns;
+
+    /* Insert then cancel everything, no simulated time passes */
+    t0 = host_clock_ns();
+    arm(count);
+    insert_ns = host_clock_ns() - t0;
+
+    t0 = host_clock_ns();
+    for (uint16_t id = 0; id < count; id++) {
+        zassert_ok(sched_del(id));
+    }
+    cancel_ns = host_clock_ns() - t0;
+
+    /* Arm again and let it all fire */
+    fired = 0;
+    jitter_max_ms = 0;
+    armed_at = k_uptime_get();
+    arm(count);
+
+    t0 = host_clock_ns();
+    k_sleep(K_SECONDS(SPREAD_S + 1));
+    fire_ns = host_clock_ns() - t0;
+
+    zassert_equal(fired, count, "%u of %u entries fired", fired, count);
+    zassert_true(jitter_max_ms <= CONFIG_APP_SCHED_TICK_MS, "jitter %lld ms", (long long)jitter_max_ms);
+
+    /* Fire cost includes the k_timer and work queue around each batch */
+    TC_PRINT("%5u entries: insert %llu ns, cancel %llu ns, fire %llu ns per entry, "
+             "jitter max %lld ms\n", count, (unsigned long long)(insert_ns / count),
+             (unsigned long long)(cancel_ns / count), (unsigned long long)(fire_ns / count),
+             (long long)jitter_max_ms);
+}
+
+ZTEST(sched_bench, test_10) {
+    bench(10);
+}
+
+ZTEST(sched_bench, test_1k) {
+    bench(1000);
+}
+
+ZTEST(sched_bench, test_10k) {
+    bench(10000);
+}
+
+ZTEST_SUITE(sched_bench, NULL, NULL, NULL, NULL, NULL);
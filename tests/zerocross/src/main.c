@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2024 Muhammad Waleed.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Feed synthetic 50/60 Hz zero-cross edges through the emulated GPIO and
+ * check that queued relay writes land on the predicted crossings.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/gpio/gpio_emul.h>
+
+#include "gpio.h"
+#include "zerocross.h"
+
+/* Normally defined in gpio.c, which the test does not build */
+struct gpio_dt_spec relays[maxRelays] = {
+    GPIO_DT_SPEC_GET(DT_ALIAS(rly0), gpios),
+    GPIO_DT_SPEC_GET(DT_ALIAS(rly1), gpios),
+};
+
+static const struct gpio_dt_spec zc_pin = GPIO_DT_SPEC_GET(DT_ALIAS(zc0), gpios);
+
+/* Timer tick resolution plus scheduling slack on native_sim */
+#define ERROR_MAX_US 200
+
+static void mains_handler(struct k_timer *timer) {
+    /* One rising edge per crossing, like an optocoupler detector */
+    gpio_emul_input_set(zc_pin.port, zc_pin.pin, 0);
+    gpio_emul_input_set(zc_pin.port, zc_pin.pin, 1);
+}
+
+static K_TIMER_DEFINE(mains, mains_handler, NULL);
+
+static void mains_start(uint32_t hz) {
+    uint32_t half_us = USEC_PER_SEC / (2 * hz);
+
+    k_timer_start(&mains, K_USEC(half_us), K_USEC(half_us));
+    /* Lock and let the 1/8 IIR settle on the new frequency */
+    k_msleep(500);
+}
+
+static int relay_out(uint8_t index) {
+    return gpio_emul_output_get(relays[index].port, relays[index].pin);
+}
+
+static void switch_group(uint32_t hz, bool state) {
+    uint32_t half_us = USEC_PER_SEC / (2 * hz);
+    struct zc_stats before, after;
+
+    zc_stats_get(&before);
+    zassert_true(before.locked, "no lock at %u Hz", hz);
+    zassert_within(before.half_cycle_us, half_us, 100, "half-cycle %u us", before.half_cycle_us);
+
+    for (uint8_t index = 0; index < maxRelays; index++) {
+        zassert_true(zc_queue(index, state), "relay %u not queued", index);
+        zassert_not_equal(relay_out(index), state, "relay %u switched early", index);
+    }
+
+    /* One relay per half-cycle, then one more edge to measure the error */
+    k_usleep((maxRelays + 2) * half_us);
+
+    zc_stats_get(&after);
+    for (uint8_t index = 0; index < maxRelays; index++) {
+        zassert_equal(relay_out(index), state, "relay %u not switched", index);
+    }
+    zassert_equal(after.releases - before.releases, maxRelays);
+
+    TC_PRINT("%u Hz: timing error last %d us max %u us, queueing delay last %u us max %u us\n",
+             hz, after.error_us, after.error_max_us, after.delay_us, after.delay_max_us);
+
+    zassert_true(after.error_max_us <= ERROR_MAX_US, "timing error %u us", after.error_max_us);
+    /* Staggered: the last relay waits at most GROUP-sized batches ahead of it */
+    zassert_true(after.delay_max_us <= (maxRelays + 1) * half_us + ERROR_MAX_US,
+                 "queueing delay %u us", after.delay_max_us);
+}
+
+static void *zc_setup(void) {
+    for (uint8_t index = 0; index < maxRelays; index++) {
+        gpio_pin_configure_dt(&relays[index], GPIO_OUTPUT_INACTIVE);
+    }
+    zassert_ok(zc_init());
+
+    return NULL;
+}
+
+static void zc_after(void *fixture) {
+    k_timer_stop(&mains);
+}
+
+ZTEST(zerocross, test_50hz) {
+    mains_start(50);
+    switch_group(50, true);
+    switch_group(50, false);
+}
+
+ZTEST(zerocross, test_60hz) {
+    mains_start(60);
+    switch_group(60, true);
+    switch_group(60, false);
+}
+
+ZTEST(zerocross, test_lock_held_after_release) {
+    mains_start(50);
+    switch_group(50, true);
+
+    /* Past the edge-loss timeout while edges keep coming */
+    k_msleep(100);
+
+    zassert_true(zc_queue(0, false), "lock dropped after release");
+    k_msleep(30);
+    zassert_equal(relay_out(0), 0);
+}
+
+ZTEST(zerocross, test_edges_lost) {
+    mains_start(50);
+    k_timer_stop(&mains);
+    k_msleep(50);
+
+    /* No mains: writes go straight to the pin */
+    zassert_false(zc_queue(1, true), "queued without mains");
+}
+
+ZTEST_SUITE(zerocross, NULL, zc_setup, NULL, zc_after, NULL);